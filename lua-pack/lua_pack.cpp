@@ -0,0 +1,384 @@
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <charconv>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+
+#include <lua.hpp>
+#include <lua_util_chunk.h>
+
+namespace fs = std::filesystem;
+
+/// a lua source file, module_name is its path relative to the source dir without ".lua"
+struct lua_source {
+  std::string module_name;
+  fs::path path;
+};
+
+struct pack_options {
+  fs::path source_dir;
+  fs::path output;
+  fs::path hot_order;
+  fs::path cache_dir;
+  size_t jobs = 0; // 0 for every core
+  bool checksum = false;
+  bool strip = true;
+};
+
+static void usage() {
+  std::cerr << "usage: lua-pack <source_dir> <output> [--checksum] [--no-strip] [--hot-order <file>]" << std::endl
+            << "                [--jobs <n>] [--cache <dir>]" << std::endl
+            << "       lua-pack --embed <archive> <output.h> <name>" << std::endl
+            << "  --checksum   store a crc32c per chunk, verified on first access" << std::endl
+            << "  --no-strip   keep debug information in the bytecode" << std::endl
+            << "  --hot-order  a file of module names or chunk ids, one per line, in startup load order" << std::endl
+            << "  --jobs       the count of compile threads, every core by default" << std::endl
+            << "  --cache      a directory of compiled bytecode keyed by source content hash" << std::endl
+            << "  --embed      write an archive as a constexpr array with its index, see lua_embed" << std::endl;
+}
+
+static std::vector<uint8_t> read_file(const fs::path &path) {
+  auto f = std::ifstream(path, std::ios::in | std::ios::binary);
+  if (!f.is_open()) throw std::runtime_error("failed to open " + path.string());
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static std::vector<lua_source> collect_sources(const fs::path &source_dir) {
+  auto result = std::vector<lua_source>();
+  for (const auto &entry : fs::recursive_directory_iterator(source_dir)) {
+    if (!entry.is_regular_file() || entry.path().extension() != ".lua") continue;
+    auto name = entry.path().lexically_relative(source_dir).replace_extension().generic_string();
+    result.push_back({ std::move(name), entry.path() });
+  }
+
+  // 排序后输出稳定, 且父路径总在子路径之前
+  std::sort(result.begin(), result.end(),
+    [](const lua_source &a, const lua_source &b) { return a.module_name < b.module_name; });
+  return result;
+}
+
+static int write_dump(lua_State*, const void *data, size_t size, void *ud) {
+  auto* out = (std::vector<uint8_t>*)ud;
+  out->insert(out->end(), (const uint8_t*)data, (const uint8_t*)data + size);
+  return 0;
+}
+
+static std::vector<uint8_t>
+compile(lua_State *L, const lua_source &source, std::span<const uint8_t> code, bool strip) {
+  const auto chunk_name = "@" + source.module_name + ".lua";
+  if (luaL_loadbuffer(L, (const char*)code.data(), code.size(), chunk_name.c_str())) {
+    auto error = std::string(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    throw std::runtime_error(error);
+  }
+
+  auto result = std::vector<uint8_t>();
+#if LUA_VERSION_NUM >= 503
+  lua_dump(L, write_dump, &result, strip);
+#else
+  lua_dump(L, write_dump, &result);
+#endif
+  lua_pop(L, 1);
+  return result;
+}
+
+static void write_file(const fs::path &path, std::span<const uint8_t> data) {
+  auto f = std::ofstream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!f.is_open()) throw std::runtime_error("failed to open " + path.string());
+  f.write((const char*)data.data(), data.size());
+  if (!f) throw std::runtime_error("failed to write " + path.string());
+}
+
+/// bytecode cache
+/// compiled bytecode stored by the hash of everything that decides it: the
+/// source, the chunk name, the strip flag and the lua version.
+class bytecode_cache {
+public:
+  explicit bytecode_cache(fs::path dir) : _dir(std::move(dir)) {
+    if (!_dir.empty()) fs::create_directories(_dir);
+  }
+
+  inline bool enabled() const { return !_dir.empty(); }
+
+  static uint64_t key(const lua_source &source, std::span<const uint8_t> code, bool strip) {
+    const auto &name = source.module_name;
+    const auto seed = lua_util::hash_bytes({ (const uint8_t*)name.data(), name.size() },
+                                           (uint64_t)LUA_VERSION_NUM << 1 | strip);
+    return lua_util::hash_bytes(code, seed);
+  }
+
+  bool load(uint64_t key, std::vector<uint8_t> &out) const {
+    std::error_code ec;
+    const auto path = entry_path(key);
+    if (!fs::is_regular_file(path, ec)) return false;
+    out = read_file(path);
+    return !out.empty();
+  }
+
+  void store(uint64_t key, std::span<const uint8_t> data) const {
+    // 先写临时文件再改名, 并发的打包进程不会读到写了一半的缓存
+    const auto path = entry_path(key);
+    auto temp = path;
+    temp += "." + std::to_string(std::random_device()()) + ".tmp";
+    write_file(temp, data);
+    std::error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec) fs::remove(temp, ec);
+  }
+
+private:
+  fs::path entry_path(uint64_t key) const {
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.luac", (unsigned long long)key);
+    return _dir / name;
+  }
+
+  fs::path _dir;
+};
+
+/// compile the sources on several threads, each with its own lua_State
+/// @return the bytecode of each source, in source order
+static std::vector<std::vector<uint8_t>>
+compile_all(const std::vector<lua_source> &sources, const pack_options &options, size_t &cache_hits) {
+  const auto cache = bytecode_cache(options.cache_dir);
+  auto result = std::vector<std::vector<uint8_t>>(sources.size());
+
+  auto next = std::atomic<size_t>(0);
+  auto hits = std::atomic<size_t>(0);
+  auto error_mutex = std::mutex();
+  auto error = std::exception_ptr();
+
+  const auto worker = [&] {
+    lua_State* L = nullptr;
+    try {
+      for (size_t i = next++; i < sources.size(); i = next++) {
+        const auto code = read_file(sources[i].path);
+        const auto key = cache.enabled() ? bytecode_cache::key(sources[i], code, options.strip) : 0;
+        if (cache.enabled() && cache.load(key, result[i])) {
+          hits++;
+          continue;
+        }
+
+        if (!L && !(L = luaL_newstate())) throw std::runtime_error("failed to create lua state");
+        result[i] = compile(L, sources[i], code, options.strip);
+        if (cache.enabled()) cache.store(key, result[i]);
+      }
+    } catch (...) {
+      const auto lock = std::lock_guard(error_mutex);
+      if (!error) error = std::current_exception();
+      next = sources.size(); // 让其他线程尽快结束
+    }
+    if (L) lua_close(L);
+  };
+
+  auto jobs = options.jobs ? options.jobs : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  jobs = std::min(jobs, std::max<size_t>(sources.size(), 1));
+  auto threads = std::vector<std::thread>();
+  threads.reserve(jobs - 1);
+  for (size_t i = 1; i < jobs; i++) threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads) thread.join();
+
+  if (error) std::rethrow_exception(error);
+  cache_hits = hits;
+  return result;
+}
+
+/// @return the lines of the file, module names or chunk ids
+static std::vector<std::string> read_hot_order(const fs::path &path) {
+  auto f = std::ifstream(path);
+  if (!f.is_open()) throw std::runtime_error("failed to open " + path.string());
+
+  auto result = std::vector<std::string>();
+  for (std::string line; std::getline(f, line);) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+    if (!line.empty()) result.push_back(std::move(line));
+  }
+  return result;
+}
+
+static void pack(const pack_options &options) {
+  using namespace lua_util;
+
+  const auto sources = collect_sources(options.source_dir);
+
+  // 1. 并行编译所有源文件, chunk id 从 1 开始按模块名顺序分配
+  size_t cache_hits = 0;
+  const auto bytecode = compile_all(sources, options, cache_hits);
+
+  // 2. 构建路径树和路径片段
+  auto tree = id_tree();
+  auto parts = path_part_collection();
+  auto part_ids = std::unordered_map<std::string, size_t>();
+  auto module_paths = std::unordered_map<std::string, uint64_t>();
+  for (size_t i = 0; i < sources.size(); i++) {
+    const auto chunk_id = (uint64_t)i + 1;
+    const auto &name = sources[i].module_name;
+
+    auto ids = std::vector<size_t>();
+    path_part_collection::enumerate_path(name, [&](const std::string_view &part) {
+      if (part == path_part_collection::CURR_DIR) return;
+      const auto [it, inserted] = part_ids.try_emplace(std::string(part), part_ids.size() + 1);
+      if (inserted) parts.add_part(part, it->second);
+      ids.push_back(it->second);
+    });
+
+    id_tree* node = &tree;
+    for (size_t j = 0; j < ids.size(); j++) {
+      auto idx = node->find(ids[j]);
+      if (idx == id_tree::NULL_IDX) idx = node->push(ids[j], j + 1 == ids.size() ? chunk_id : id_tree::NULL_DATA);
+      node = &node->get_child(idx);
+    }
+
+    // require 通常使用 "a.b" 的形式, 两种写法都加入索引
+    // "a/b.lua" 和 "a.b.lua" 得到相同的名字, 不能静默丢弃其中一个
+    auto dotted = name;
+    std::replace(dotted.begin(), dotted.end(), '/', '.');
+    for (auto &path : { name, dotted }) {
+      const auto [it, inserted] = module_paths.try_emplace(path, chunk_id);
+      if (!inserted && it->second != chunk_id) {
+        throw std::runtime_error("module name '" + path + "' is used by both " +
+          sources[it->second - 1].path.string() + " and " + sources[i].path.string());
+      }
+    }
+  }
+
+  auto tree_bytes = std::vector<uint8_t>();
+  auto parts_bytes = std::vector<uint8_t>();
+  id_tree_view::serialize(tree, tree_bytes);
+  parts.serialize(parts_bytes);
+
+  // 3. 写出 archive, 元数据在启动时最先读取, 放在热区前面
+  auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>();
+  for (size_t i = 0; i < bytecode.size(); i++)
+    chunks[(uint64_t)i + 1] = { const_cast<uint8_t*>(bytecode[i].data()), bytecode[i].size() };
+  chunks[chunk::TREE_ID] = tree_bytes;
+  chunks[chunk::PATH_PARTS_ID] = parts_bytes;
+
+  auto build_options = chunk::build_options();
+  build_options.checksum = options.checksum;
+  build_options.module_paths = std::move(module_paths);
+  build_options.hot_order = { chunk::TREE_ID, chunk::PATH_PARTS_ID };
+  if (!options.hot_order.empty()) {
+    for (const auto &name : read_hot_order(options.hot_order)) {
+      const auto it = build_options.module_paths.find(name);
+      if (it != build_options.module_paths.end()) {
+        build_options.hot_order.push_back(it->second);
+        continue;
+      }
+
+      // lua_custom_requirer::load_order 输出的 chunk id, 与本工具分配的 id 一致
+      uint64_t id = 0;
+      const auto [end, ec] = std::from_chars(name.data(), name.data() + name.size(), id);
+      if (ec == std::errc() && end == name.data() + name.size() && id >= 1 && id <= sources.size()) {
+        build_options.hot_order.push_back(id);
+        continue;
+      }
+      std::cerr << "lua-pack: hot module not found, skipped: " << name << std::endl;
+    }
+  }
+
+  const auto buffer = chunk::build_chunk_buffer(chunks, build_options);
+  write_file(options.output, buffer);
+
+  std::cout << "lua-pack: " << sources.size() << " modules (" << cache_hits << " cached), "
+            << buffer.size() << " bytes -> " << options.output.string() << std::endl;
+}
+
+/// write an archive as a header of constexpr data, the index is parsed here so
+/// the program never reads the archive header
+static void embed(const fs::path &archive, const fs::path &output, const std::string &name) {
+  using namespace lua_util;
+
+  const auto valid_name = !name.empty() && !std::isdigit((unsigned char)name[0]) &&
+    std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum((unsigned char)c) || c == '_'; });
+  if (!valid_name) throw std::runtime_error("invalid embed name: " + name);
+
+  const auto data = read_file(archive);
+  auto h = chunk::read_header([&](uint64_t offset, std::span<uint8_t> out) {
+    std::memcpy(out.data(), data.data() + offset, out.size());
+  }, data.size());
+  std::sort(h.entries.begin(), h.entries.end(), [](const auto &a, const auto &b) { return a.id < b.id; });
+
+  auto f = std::ofstream(output, std::ios::out | std::ios::trunc);
+  if (!f.is_open()) throw std::runtime_error("failed to open " + output.string());
+
+  f << "// generated by lua-pack from " << archive.filename().string() << ", do not edit\n"
+    << "#pragma once\n\n"
+    << "#include <lua_util_chunk.h>\n\n"
+    << "namespace lua_embedded {\n\n"
+    << "alignas(8) inline constexpr uint8_t " << name << "_data[" << std::max<size_t>(data.size(), 1) << "] = {";
+  char hex[8];
+  for (size_t i = 0; i < data.size(); i++) {
+    std::snprintf(hex, sizeof(hex), "0x%02x,", data[i]);
+    f << (i % 16 ? "" : "\n  ") << hex;
+  }
+  f << "\n};\n\n";
+
+  // 按 id 排序, 可在编译期用 chunk::find_entry 查找
+  f << "inline constexpr lua_util::chunk::entry " << name << "_entries[" << std::max<size_t>(h.entries.size(), 1) << "] = {\n";
+  for (const auto &e : h.entries)
+    f << "  { " << e.id << "ull, " << e.offset << "ull, " << e.size << "ull, " << e.crc << "u },\n";
+  f << "};\n\n"
+    << "/// wrap the embedded archive, nothing is copied or read from disk\n"
+    << "inline lua_util::chunk " << name << "() {\n"
+    << "  return lua_util::chunk::borrow(\n"
+    << "    { " << name << "_data, " << data.size() << " },\n"
+    << "    { " << name << "_entries, " << h.entries.size() << " },\n"
+    << "    " << (h.checksum ? "true" : "false") << ");\n"
+    << "}\n\n"
+    << "} // namespace lua_embedded\n";
+  if (!f) throw std::runtime_error("failed to write " + output.string());
+}
+
+int main(int argc, char **argv) {
+  if (argc == 5 && std::string_view(argv[1]) == "--embed") {
+    try {
+      embed(argv[2], argv[3], argv[4]);
+    } catch (const std::exception &e) {
+      std::cerr << "lua-pack: " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  auto options = pack_options();
+  auto positional = std::vector<std::string>();
+  for (int i = 1; i < argc; i++) {
+    const auto arg = std::string_view(argv[i]);
+    if (arg == "--checksum") options.checksum = true;
+    else if (arg == "--no-strip") options.strip = false;
+    else if (arg == "--hot-order" && i + 1 < argc) options.hot_order = argv[++i];
+    else if (arg == "--cache" && i + 1 < argc) options.cache_dir = argv[++i];
+    else if (arg == "--jobs" && i + 1 < argc) options.jobs = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg.starts_with("--")) {
+      usage();
+      return 1;
+    } else positional.emplace_back(arg);
+  }
+  if (positional.size() != 2) {
+    usage();
+    return 1;
+  }
+  options.source_dir = positional[0];
+  options.output = positional[1];
+
+  try {
+    pack(options);
+  } catch (const std::exception &e) {
+    std::cerr << "lua-pack: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
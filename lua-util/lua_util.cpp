@@ -1,5 +1,8 @@
+#include <climits>
 #include <sstream>
+#include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "lua_util.hpp"
@@ -127,6 +130,157 @@ void lua_env::unref(const lua_ref &ref) {
   delete _ref;
 }
 
+namespace {
+
+/// copies values between two states, tables and long strings are memoized in a
+/// table on the destination stack so shared tables, cycles and repeated strings
+/// are copied once
+class value_copier {
+public:
+  /// tables nested deeper than this are rejected
+  static constexpr int MAX_DEPTH = 200;
+  /// strings at least this long are memoized, shorter ones are interned by lua anyway
+  static constexpr size_t MEMO_MIN_SIZE = 40;
+
+  value_copier(lua_State *from, lua_State *to, int memo) : _from(from), _to(to), _memo(memo) {}
+
+  const char* copy(int idx, int depth) {
+    if (!lua_checkstack(_from, 3) || !lua_checkstack(_to, 4)) return "lua_env: stack overflow";
+
+    switch (lua_type(_from, idx)) {
+    case LUA_TNIL:
+      lua_pushnil(_to);
+      return nullptr;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(_to, lua_toboolean(_from, idx));
+      return nullptr;
+    case LUA_TLIGHTUSERDATA:
+      lua_pushlightuserdata(_to, lua_touserdata(_from, idx));
+      return nullptr;
+    case LUA_TNUMBER:
+      if (lua_isinteger(_from, idx)) lua_pushinteger(_to, lua_tointeger(_from, idx));
+      else lua_pushnumber(_to, lua_tonumber(_from, idx));
+      return nullptr;
+    case LUA_TSTRING:
+      copy_string(idx);
+      return nullptr;
+    case LUA_TTABLE:
+      return copy_table(idx, depth);
+    default:
+      return "lua_env: cannot copy a function, userdata or thread";
+    }
+  }
+
+private:
+  void copy_string(int idx) {
+    size_t size = 0;
+    const char* data = lua_tolstring(_from, idx, &size);
+    if (size < MEMO_MIN_SIZE) {
+      lua_pushlstring(_to, data, size);
+      return;
+    }
+
+    // 同一个长字符串只复制一次
+    const auto [it, inserted] = _slots.try_emplace(data, _slots.size() + 1);
+    if (!inserted) {
+      lua_rawgeti(_to, _memo, it->second);
+      return;
+    }
+    lua_pushlstring(_to, data, size);
+    lua_pushvalue(_to, -1);
+    lua_rawseti(_to, _memo, it->second);
+  }
+
+  const char* copy_table(int idx, int depth) {
+    const auto [it, inserted] = _slots.try_emplace(lua_topointer(_from, idx), _slots.size() + 1);
+    if (!inserted) {
+      lua_rawgeti(_to, _memo, it->second);
+      return nullptr;
+    }
+    if (depth >= MAX_DEPTH) return "lua_env: table nested too deep";
+
+    // 1. 先统计数组和哈希部分的大小, 目标表一次分配
+    idx = lua_absindex(_from, idx);
+    const auto array_size = lua_rawlen(_from, idx);
+    size_t hash_size = 0;
+    lua_pushnil(_from);
+    while (lua_next(_from, idx)) {
+      lua_pop(_from, 1);
+      if (lua_isinteger(_from, -1)) {
+        const auto key = lua_tointeger(_from, -1);
+        if (key >= 1 && (lua_Unsigned)key <= array_size) continue;
+      }
+      hash_size++;
+    }
+
+    lua_createtable(_to, (int)std::min<size_t>(array_size, INT_MAX), (int)std::min<size_t>(hash_size, INT_MAX));
+    const int table = lua_gettop(_to);
+    lua_pushvalue(_to, table);
+    lua_rawseti(_to, _memo, it->second);
+
+    // 2. 逐个复制键值
+    for (lua_Integer i = 1; i <= (lua_Integer)array_size; i++) {
+      lua_rawgeti(_from, idx, i);
+      const auto error = copy(-1, depth + 1);
+      lua_pop(_from, 1);
+      if (error) return error;
+      lua_rawseti(_to, table, i);
+    }
+
+    lua_pushnil(_from);
+    while (lua_next(_from, idx)) {
+      if (lua_isinteger(_from, -2)) {
+        const auto key = lua_tointeger(_from, -2);
+        if (key >= 1 && (lua_Unsigned)key <= array_size) {
+          lua_pop(_from, 1);
+          continue;
+        }
+      }
+      auto error = copy(-2, depth + 1);
+      if (!error) error = copy(-1, depth + 1);
+      if (error) {
+        lua_pop(_from, 2);
+        return error;
+      }
+      lua_pop(_from, 1);
+      lua_rawset(_to, table);
+    }
+    return nullptr;
+  }
+
+  lua_State* _from;
+  lua_State* _to;
+  int _memo;
+  std::unordered_map<const void*, lua_Integer> _slots;
+};
+
+}
+
+const char* lua_env::copy_from(lua_env &src, int idx) {
+  CHECK_LUA;
+  if (!src._env) return "lua_env: invalid source state";
+
+  if (src._env == _env) {
+    lua_pushvalue(_env, idx);
+    return nullptr;
+  }
+
+  const int top = lua_gettop(_env);
+  const int src_top = lua_gettop(src._env);
+  idx = lua_absindex(src._env, idx);
+  if (!lua_checkstack(_env, 2)) return "lua_env: stack overflow";
+
+  lua_newtable(_env); // memo
+  auto error = value_copier(src._env, _env, top + 1).copy(idx, 0);
+  lua_settop(src._env, src_top);
+  if (error) {
+    lua_settop(_env, top);
+    return error;
+  }
+  lua_remove(_env, top + 1);
+  return nullptr;
+}
+
 std::string lua_env::stack_dump(int nPreStack) {
   CHECK_LUA;
   return lua_util::stack_dump(_env, nPreStack);
@@ -5,6 +5,7 @@
 #include <tuple>
 #include <string>
 #include <utility>
+#include <iterator>
 #include <stdexcept>
 #include <string_view>
 #include <unordered_set>
@@ -120,6 +121,15 @@ public:
   const char* load(const char* name, const uint8_t* buffer, size_t size);
   inline void push() { lua_pushvalue(_env, -1); }
 
+  /// copy a value of another state onto the top of this state
+  /// tables are rebuilt presized, with shared tables and cycles kept, and long
+  /// strings repeated in the value are pushed once. metatables are not copied,
+  /// functions, userdata and threads are rejected
+  /// @param src: the source state
+  /// @param idx: the index of the value in src, its stack is left unchanged
+  /// @return nullptr on success, the error otherwise and nothing is pushed
+  const char* copy_from(lua_env &src, int idx);
+
 public:
   void unref(const lua_ref &ref);
   lua_ref ref(const int32_t &idx);
@@ -218,7 +228,7 @@ public:
   template<typename Arr>
   void bind(const Arr& arr)
   requires std::is_same_v<typename Arr::value_type, lua_bind_data> &&
-  std::is_base_of<std::forward_iterator_tag, typename Arr::iterator::iterator_category>::value
+  std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<typename Arr::iterator>::iterator_category>::value
   {
     if (!_env) throw std::runtime_error("invalid lua state");
     for (auto it = arr.begin(); it != arr.end(); ++it) {
@@ -230,7 +240,7 @@ public:
   template<typename Arr>
   void bind(const std::string_view& tablePath, const Arr& arr)
   requires std::is_same_v<typename Arr::value_type, lua_bind_data> &&
-  std::is_base_of<std::forward_iterator_tag, typename Arr::iterator::iterator_category>::value
+  std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<typename Arr::iterator>::iterator_category>::value
   {
     if (!_env) throw std::runtime_error("invalid lua state");
 
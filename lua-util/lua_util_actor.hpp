@@ -0,0 +1,258 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "lua_util.hpp"
+
+namespace lua_util {
+
+/// mpsc queue
+/// a lock-free multi-producer single-consumer intrusive queue (Vyukov). push is
+/// one atomic exchange, pop is wait-free for the single consumer. a node is
+/// owned by the queue from push until pop returns it.
+template<typename Node>
+class mpsc_queue {
+public:
+  mpsc_queue() : _head(&_stub), _tail(&_stub) {}
+
+  mpsc_queue(const mpsc_queue&) = delete;
+  mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+  /// push a node, from any thread
+  void push(Node *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto* prev = _head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  /// pop a node, from the consumer thread only
+  /// @return the node, or nullptr if the queue is empty or a push is half done
+  Node* pop() {
+    auto* tail = _tail;
+    auto* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &_stub) {
+      if (!next) return nullptr;
+      _tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      _tail = next;
+      return tail;
+    }
+
+    // tail 是最后一个节点, 放回 stub 后才能取出
+    if (tail != _head.load(std::memory_order_acquire)) return nullptr;
+    push(&_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (!next) return nullptr;
+    _tail = next;
+    return tail;
+  }
+
+private:
+  alignas(64) std::atomic<Node*> _head;
+  alignas(64) Node* _tail;
+  Node _stub;
+};
+
+/// env actor
+/// owns a lua_env and the thread that runs it. any thread may submit work or
+/// calls without a lock, they run one by one on the actor thread in push order
+/// per producer, and their results come back through futures. the env must only
+/// be touched from submitted work; refs used by call must come from it too.
+class env_actor {
+public:
+  /// start the actor thread
+  /// @param setup: run first on the actor thread, e.g. to bind functions and load scripts
+  /// @throw the exception thrown by setup, after the actor thread has stopped
+  explicit env_actor(std::function<void(lua_env &env)> setup = {}) {
+    auto ready = setup ? submit(std::move(setup)) : std::future<void>();
+    _thread = std::thread([this] { run(); });
+    if (!ready.valid()) return;
+    try {
+      ready.get();
+    } catch (...) {
+      // 构造失败不会调用析构函数, 在这里停止线程
+      stop();
+      throw;
+    }
+  }
+
+  /// run the queued work, then stop the actor thread
+  /// work submitted after the destructor started is dropped, its future gets broken_promise
+  ~env_actor() { stop(); }
+
+  env_actor(const env_actor&) = delete;
+  env_actor& operator=(const env_actor&) = delete;
+
+  /// run a function on the actor thread
+  /// @param func: called with the env, its exceptions are stored in the future
+  /// @return the future of the result
+  template<typename F>
+  auto submit(F &&func) -> std::future<std::invoke_result_t<F, lua_env&>> {
+    using R = std::invoke_result_t<F, lua_env&>;
+    auto* t = new work_task<R>(std::packaged_task<R(lua_env&)>(std::forward<F>(func)));
+    auto future = t->work.get_future();
+    enqueue(t);
+    return future;
+  }
+
+  /// call a lua function on the actor thread
+  /// @tparam R: the result type, void to drop the results
+  /// @param func: the ref of the function, made in this actor's env
+  /// @param args: the arguments, copied into the request, C strings as std::string
+  /// @return the future of the result, a lua error or a result not convertible to R
+  ///         is stored as std::runtime_error
+  template<typename R = void, typename... Args>
+  std::future<R> call(lua_ref func, Args... args) {
+    static_assert(!is_c_string<R>, "env_actor: a C string result would outlive its lua string, use std::string");
+    return submit([func, ...args = stored_t<Args>(std::move(args))](lua_env &env) -> R {
+      return invoke<R>(env, func, args...);
+    });
+  }
+
+private:
+  struct task {
+    std::atomic<task*> next = nullptr;
+    virtual ~task() = default;
+    /// @return false to stop the actor
+    virtual bool run(lua_env &) { return true; }
+  };
+
+  template<typename R>
+  struct work_task : task {
+    explicit work_task(std::packaged_task<R(lua_env&)> &&work) : work(std::move(work)) {}
+    bool run(lua_env &env) override {
+      work(env);
+      return true;
+    }
+    std::packaged_task<R(lua_env&)> work;
+  };
+
+  struct stop_task : task {
+    bool run(lua_env &) override { return false; }
+  };
+
+  template<typename T>
+  static constexpr bool is_c_string = std::is_same_v<std::decay_t<T>, const char*> || std::is_same_v<std::decay_t<T>, char*>;
+
+  /// 请求里保存的参数类型, C 字符串要复制内容
+  template<typename T>
+  using stored_t = std::conditional_t<is_c_string<T>, std::string, T>;
+
+  template<typename R, typename... Args>
+  static R invoke(lua_env &env, lua_ref func, const Args&... args) {
+    auto* L = env.env();
+    const int top = lua_gettop(L);
+    if (!env.push(func)) throw std::runtime_error("env_actor: invalid ref");
+    (arg<Args>::push(L, args), ...);
+
+    if (lua_pcall(L, (int)sizeof...(Args), std::is_void_v<R> ? 0 : 1, 0)) {
+      // 错误对象不一定是字符串, 例如 error({})
+      const auto type = lua_type(L, -1);
+      auto error = type == LUA_TSTRING || type == LUA_TNUMBER ?
+        std::string(lua_tostring(L, -1)) : std::string("(error object is a ") + luaL_typename(L, -1) + " value)";
+      lua_settop(L, top);
+      throw std::runtime_error(error);
+    }
+    if constexpr (std::is_void_v<R>) {
+      lua_settop(L, top);
+    } else {
+      // arg<R>::get 出错会在保护调用之外抛出 lua 错误, 先检查类型
+      constexpr int expected = result_type<R>();
+      if constexpr (expected != LUA_TNONE) {
+        if (lua_type(L, -1) != expected) {
+          auto error = std::string("env_actor: result must be a ") + lua_typename(L, expected) +
+            ", got " + luaL_typename(L, -1);
+          lua_settop(L, top);
+          throw std::runtime_error(error);
+        }
+        auto r = arg<R>::get(L, -1);
+        lua_settop(L, top);
+        return r;
+      } else {
+        // 其它类型的检查在 arg<R>::get 内, 放到保护调用里执行
+        auto r = std::optional<R>();
+        lua_pushcfunction(L, &get_result<R>);
+        lua_pushlightuserdata(L, &r);
+        lua_pushvalue(L, -3);
+        if (lua_pcall(L, 2, 0, 0)) {
+          auto error = std::string("env_actor: invalid result: ") +
+            (lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : luaL_typename(L, -1));
+          lua_settop(L, top);
+          throw std::runtime_error(error);
+        }
+        lua_settop(L, top);
+        return std::move(*r);
+      }
+    }
+  }
+
+  /// the lua type arg<R>::get accepts, LUA_TNONE if only arg<R> knows
+  template<typename R>
+  static constexpr int result_type() {
+    if constexpr (std::is_same_v<R, bool>) return LUA_TBOOLEAN;
+    else if constexpr (std::is_arithmetic_v<R>) return LUA_TNUMBER;
+    else if constexpr (std::is_same_v<R, std::string>) return LUA_TSTRING;
+    else return LUA_TNONE;
+  }
+
+  /// 1: the std::optional<R> to fill, 2: the value
+  template<typename R>
+  static int get_result(lua_State *L) {
+    ((std::optional<R>*)lua_touserdata(L, 1))->emplace(arg<R>::get(L, 2));
+    return 0;
+  }
+
+  /// run the queued work, then join the actor thread
+  void stop() {
+    enqueue(new stop_task());
+    _thread.join();
+    while (auto* t = _queue.pop()) delete t;
+  }
+
+  void enqueue(task *t) {
+    _queue.push(t);
+    // 仅在消费者可能休眠时唤醒
+    _signal.fetch_add(1, std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_seq_cst)) _signal.notify_one();
+  }
+
+  void run() {
+    for (;;) {
+      const auto seen = _signal.load(std::memory_order_acquire);
+      auto* t = _queue.pop();
+      if (!t) {
+        // 声明休眠后再检查一次, 避免错过唤醒
+        _sleeping.store(true, std::memory_order_seq_cst);
+        if (_signal.load(std::memory_order_seq_cst) == seen) _signal.wait(seen, std::memory_order_acquire);
+        _sleeping.store(false, std::memory_order_relaxed);
+        continue;
+      }
+
+      const auto keep_running = t->run(_env);
+      delete t;
+      if (!keep_running) return;
+    }
+  }
+
+  lua_env _env;
+  mpsc_queue<task> _queue;
+  std::atomic<uint32_t> _signal = 0;
+  std::atomic<bool> _sleeping = false;
+  std::thread _thread;
+};
+
+}
@@ -148,9 +148,10 @@ struct arg<char[s]> {
   static inline void push(lua_State* L, const char* value) { lua_pushstring(L, value); }
 };
 
+/// @param first: the stack index of the first argument, 2 after a self argument
 template<typename... Args, size_t... Is>
-void lua_util_extract_args(lua_State* L, std::tuple<Args...>& tuple, std::index_sequence<Is...>) {
-  ((std::get<Is>(tuple) = arg<std::decay_t<Args>>::get(L, Is + 1)), ...);
+void lua_util_extract_args(lua_State* L, std::tuple<Args...>& tuple, std::index_sequence<Is...>, int first = 1) {
+  ((std::get<Is>(tuple) = arg<std::decay_t<Args>>::get(L, (int)Is + first)), ...);
 }
 
 }
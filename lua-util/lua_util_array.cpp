@@ -0,0 +1,410 @@
+#include <new>
+#include <limits>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+
+#include "lua_util_array.h"
+
+// 内核写成简单循环, 由编译器向量化; 归约使用多个独立累加器,
+// 无需 -ffast-math 也能打破依赖链
+constexpr size_t LANES = 8;
+
+namespace {
+
+/// a number broadcast to every index, so kernels take arrays and scalars alike
+template<typename T>
+struct scalar {
+  T value;
+  inline T operator[](size_t) const { return value; }
+};
+
+/// the accumulator of sum and dot, integers wrap in 64 bits
+template<typename T>
+using acc_t = std::conditional_t<std::is_floating_point_v<T>, double, uint64_t>;
+
+}
+
+template<typename T>
+static inline T wrap_add(T a, T b) {
+  if constexpr (std::is_integral_v<T>) return (T)((std::make_unsigned_t<T>)a + (std::make_unsigned_t<T>)b);
+  else return a + b;
+}
+
+template<typename T>
+static inline T wrap_mul(T a, T b) {
+  if constexpr (std::is_integral_v<T>) return (T)((std::make_unsigned_t<T>)a * (std::make_unsigned_t<T>)b);
+  else return a * b;
+}
+
+template<typename T, typename B>
+static void add_kernel(T* a, B b, size_t n) {
+  for (size_t i = 0; i < n; i++) a[i] = wrap_add(a[i], b[i]);
+}
+
+template<typename T, typename B>
+static void mul_kernel(T* a, B b, size_t n) {
+  for (size_t i = 0; i < n; i++) a[i] = wrap_mul(a[i], b[i]);
+}
+
+template<typename T, typename B, typename C>
+static void fma_kernel(T* a, B b, C c, size_t n) {
+  for (size_t i = 0; i < n; i++) a[i] = wrap_add(a[i], wrap_mul(b[i], c[i]));
+}
+
+template<typename T>
+static acc_t<T> dot_kernel(const T* a, const T* b, size_t n) {
+  acc_t<T> lanes[LANES] = {};
+  size_t i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    for (size_t l = 0; l < LANES; l++) lanes[l] += (acc_t<T>)a[i + l] * (acc_t<T>)b[i + l];
+  }
+  for (; i < n; i++) lanes[0] += (acc_t<T>)a[i] * (acc_t<T>)b[i];
+
+  acc_t<T> result = 0;
+  for (size_t l = 0; l < LANES; l++) result += lanes[l];
+  return result;
+}
+
+template<typename T>
+static acc_t<T> sum_kernel(const T* a, size_t n) {
+  acc_t<T> lanes[LANES] = {};
+  size_t i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    for (size_t l = 0; l < LANES; l++) lanes[l] += (acc_t<T>)a[i + l];
+  }
+  for (; i < n; i++) lanes[0] += (acc_t<T>)a[i];
+
+  acc_t<T> result = 0;
+  for (size_t l = 0; l < LANES; l++) result += lanes[l];
+  return result;
+}
+
+/// @param n: must be > 0
+template<typename T, bool MAX>
+static T minmax_kernel(const T* a, size_t n) {
+  T lanes[LANES];
+  for (size_t l = 0; l < LANES; l++) lanes[l] = a[0];
+  size_t i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    for (size_t l = 0; l < LANES; l++) {
+      const T v = a[i + l];
+      if constexpr (MAX) lanes[l] = lanes[l] < v ? v : lanes[l];
+      else lanes[l] = v < lanes[l] ? v : lanes[l];
+    }
+  }
+  for (; i < n; i++) {
+    if constexpr (MAX) lanes[0] = lanes[0] < a[i] ? a[i] : lanes[0];
+    else lanes[0] = a[i] < lanes[0] ? a[i] : lanes[0];
+  }
+
+  T result = lanes[0];
+  for (size_t l = 1; l < LANES; l++) {
+    if constexpr (MAX) result = result < lanes[l] ? lanes[l] : result;
+    else result = lanes[l] < result ? lanes[l] : result;
+  }
+  return result;
+}
+
+/// @return true if every 1 based index is within [1, size]
+template<typename I>
+static bool indices_valid(const I* idx, size_t n, size_t size) {
+  bool valid = true;
+  for (size_t i = 0; i < n; i++) valid &= (uint64_t)((int64_t)idx[i] - 1) < size;
+  return valid;
+}
+
+template<typename T, typename I>
+static void gather_kernel(T* a, const T* src, const I* idx, size_t n) {
+  for (size_t i = 0; i < n; i++) a[i] = src[idx[i] - 1];
+}
+
+template<typename T, typename I>
+static void scatter_kernel(const T* a, T* dst, const I* idx, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[idx[i] - 1] = a[i];
+}
+
+// 以下 lua 函数只持有 userdata 内的指针, lua 错误跳过栈帧时没有需要析构的对象
+
+template<typename T>
+static lua_util::typed_array<T>& to_array(lua_State *L, int idx) {
+  return *(lua_util::typed_array<T>*)luaL_checkudata(L, idx, lua_util::typed_array<T>::METATABLE);
+}
+
+/// check that an integer fits T
+template<typename T>
+static bool fits(lua_Integer value) {
+  return value >= (lua_Integer)std::numeric_limits<T>::min() && value <= (lua_Integer)std::numeric_limits<T>::max();
+}
+
+template<typename T>
+static T check_value(lua_State *L, int idx) {
+  if constexpr (std::is_floating_point_v<T>) {
+    return (T)luaL_checknumber(L, idx);
+  } else {
+    const auto value = luaL_checkinteger(L, idx);
+    if (!fits<T>(value)) luaL_argerror(L, idx, "value out of range");
+    return (T)value;
+  }
+}
+
+template<typename T>
+static void push_value(lua_State *L, T value) {
+  if constexpr (std::is_floating_point_v<T>) lua_pushnumber(L, (lua_Number)value);
+  else lua_pushinteger(L, (lua_Integer)value);
+}
+
+/// an array operand of the size of self, or nullptr for a number
+template<typename T>
+static const T* check_operand(lua_State *L, int idx, size_t size) {
+  if (lua_type(L, idx) == LUA_TNUMBER) return nullptr;
+  const auto &array = to_array<T>(L, idx);
+  if (array.size() != size) luaL_argerror(L, idx, "size mismatch");
+  return array.data().data();
+}
+
+template<typename T>
+static int array_add(lua_State *L) {
+  auto &a = to_array<T>(L, 1);
+  const T* b = check_operand<T>(L, 2, a.size());
+  if (b) add_kernel(a.data().data(), b, a.size());
+  else add_kernel(a.data().data(), scalar<T>{ check_value<T>(L, 2) }, a.size());
+  lua_settop(L, 1);
+  return 1;
+}
+
+template<typename T>
+static int array_mul(lua_State *L) {
+  auto &a = to_array<T>(L, 1);
+  const T* b = check_operand<T>(L, 2, a.size());
+  if (b) mul_kernel(a.data().data(), b, a.size());
+  else mul_kernel(a.data().data(), scalar<T>{ check_value<T>(L, 2) }, a.size());
+  lua_settop(L, 1);
+  return 1;
+}
+
+template<typename T>
+static int array_fma(lua_State *L) {
+  auto &a = to_array<T>(L, 1);
+  const T* b = check_operand<T>(L, 2, a.size());
+  const T* c = check_operand<T>(L, 3, a.size());
+  const auto bs = scalar<T>{ b ? T() : check_value<T>(L, 2) };
+  const auto cs = scalar<T>{ c ? T() : check_value<T>(L, 3) };
+  if (b && c) fma_kernel(a.data().data(), b, c, a.size());
+  else if (b) fma_kernel(a.data().data(), b, cs, a.size());
+  else if (c) fma_kernel(a.data().data(), bs, c, a.size());
+  else fma_kernel(a.data().data(), bs, cs, a.size());
+  lua_settop(L, 1);
+  return 1;
+}
+
+template<typename T>
+static int array_sum(lua_State *L) {
+  const auto &a = to_array<T>(L, 1);
+  const auto sum = sum_kernel(a.data().data(), a.size());
+  if constexpr (std::is_floating_point_v<T>) lua_pushnumber(L, (lua_Number)sum);
+  else lua_pushinteger(L, (lua_Integer)sum);
+  return 1;
+}
+
+template<typename T>
+static int array_dot(lua_State *L) {
+  const auto &a = to_array<T>(L, 1);
+  const auto &b = to_array<T>(L, 2);
+  if (b.size() != a.size()) return luaL_argerror(L, 2, "size mismatch");
+  const auto dot = dot_kernel(a.data().data(), b.data().data(), a.size());
+  if constexpr (std::is_floating_point_v<T>) lua_pushnumber(L, (lua_Number)dot);
+  else lua_pushinteger(L, (lua_Integer)dot);
+  return 1;
+}
+
+template<typename T, bool MAX>
+static int array_minmax(lua_State *L) {
+  const auto &a = to_array<T>(L, 1);
+  if (!a.size()) lua_pushnil(L);
+  else push_value(L, minmax_kernel<T, MAX>(a.data().data(), a.size()));
+  return 1;
+}
+
+template<typename T>
+static int array_fill(lua_State *L) {
+  auto &a = to_array<T>(L, 1);
+  const auto value = check_value<T>(L, 2);
+  for (auto &v : a.data()) v = value;
+  lua_settop(L, 1);
+  return 1;
+}
+
+/// gather or scatter between self and arg 2 through the index array at arg 3
+template<typename T, bool SCATTER>
+static int array_indexed(lua_State *L) {
+  auto &a = to_array<T>(L, 1);
+  auto &other = to_array<T>(L, 2);
+  const auto* i32 = (lua_util::i32_array*)luaL_testudata(L, 3, lua_util::i32_array::METATABLE);
+  const auto* i64 = i32 ? nullptr : (lua_util::i64_array*)luaL_testudata(L, 3, lua_util::i64_array::METATABLE);
+  if (!i32 && !i64) return luaL_argerror(L, 3, "i32 or i64 array expected");
+
+  const auto count = i32 ? i32->size() : i64->size();
+  if (count != a.size()) return luaL_argerror(L, 3, "size mismatch");
+  const bool valid = i32
+    ? indices_valid(i32->data().data(), count, other.size())
+    : indices_valid(i64->data().data(), count, other.size());
+  if (!valid) return luaL_argerror(L, 3, "index out of range");
+
+  if constexpr (SCATTER) {
+    if (i32) scatter_kernel(a.data().data(), other.data().data(), i32->data().data(), count);
+    else scatter_kernel(a.data().data(), other.data().data(), i64->data().data(), count);
+  } else {
+    if (i32) gather_kernel(a.data().data(), other.data().data(), i32->data().data(), count);
+    else gather_kernel(a.data().data(), other.data().data(), i64->data().data(), count);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// 元表已隐藏, 以下元方法的第一个参数只会是数组本身
+
+/// element access first, methods from the table in upvalue 1 otherwise
+template<typename T>
+static int array_index(lua_State *L) {
+  const auto &a = *(const lua_util::typed_array<T>*)lua_touserdata(L, 1);
+  if (lua_isinteger(L, 2)) {
+    const auto i = lua_tointeger(L, 2);
+    if (i >= 1 && (lua_Unsigned)i <= a.size()) push_value(L, a.data()[(size_t)(i - 1)]);
+    else lua_pushnil(L);
+    return 1;
+  }
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  return 1;
+}
+
+template<typename T>
+static int array_newindex(lua_State *L) {
+  auto &a = *(lua_util::typed_array<T>*)lua_touserdata(L, 1);
+  const auto i = luaL_checkinteger(L, 2);
+  if (i < 1 || (lua_Unsigned)i > a.size()) return luaL_argerror(L, 2, "index out of range");
+  a.data()[(size_t)(i - 1)] = check_value<T>(L, 3);
+  return 0;
+}
+
+template<typename T>
+static int array_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)((const lua_util::typed_array<T>*)lua_touserdata(L, 1))->size());
+  return 1;
+}
+
+template<typename T>
+static int array_tostring(lua_State *L) {
+  const auto &a = to_array<T>(L, 1);
+  lua_pushfstring(L, "%s array: %p (%I)", lua_util::typed_array<T>::NAME, (const void*)a.data().data(), (lua_Integer)a.size());
+  return 1;
+}
+
+template<typename T>
+static int array_gc(lua_State *L) {
+  to_array<T>(L, 1).~typed_array();
+  return 0;
+}
+
+template<typename T>
+lua_util::typed_array<T>::typed_array(size_t size) {
+  auto owner = std::make_shared<T[]>(size);
+  _data = { owner.get(), size };
+  _owner = std::move(owner);
+}
+
+/// push an empty array userdata with its metatable, the caller assigns the array
+template<typename T>
+static lua_util::typed_array<T>* new_array(lua_State *L) {
+  using array = lua_util::typed_array<T>;
+  auto* ud = new (lua_newuserdata(L, sizeof(array))) array();
+  if (luaL_newmetatable(L, array::METATABLE)) {
+    const luaL_Reg methods[] = {
+      { "add", array_add<T> },
+      { "mul", array_mul<T> },
+      { "fma", array_fma<T> },
+      { "sum", array_sum<T> },
+      { "min", array_minmax<T, false> },
+      { "max", array_minmax<T, true> },
+      { "dot", array_dot<T> },
+      { "gather", array_indexed<T, false> },
+      { "scatter", array_indexed<T, true> },
+      { "fill", array_fill<T> },
+    };
+    lua_createtable(L, 0, (int)std::size(methods));
+    for (const auto &[name, func] : methods) {
+      lua_pushcfunction(L, func);
+      lua_setfield(L, -2, name);
+    }
+    lua_pushcclosure(L, array_index<T>, 1);
+    lua_setfield(L, -2, "__index");
+
+    const luaL_Reg metamethods[] = {
+      { "__newindex", array_newindex<T> },
+      { "__len", array_len<T> },
+      { "__tostring", array_tostring<T> },
+      { "__gc", array_gc<T> },
+    };
+    for (const auto &[name, func] : metamethods) {
+      lua_pushcfunction(L, func);
+      lua_setfield(L, -2, name);
+    }
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+  }
+  lua_setmetatable(L, -2);
+  return ud;
+}
+
+template<typename T>
+void lua_util::typed_array<T>::push(lua_State *L, const typed_array &array) {
+  *new_array<T>(L) = array;
+}
+
+template<typename T>
+lua_util::typed_array<T> lua_util::typed_array<T>::check(lua_State *L, int idx) {
+  auto* ud = (typed_array*)luaL_testudata(L, idx, METATABLE);
+  if (!ud) luaL_error(L, "arg #%d must be a %s array", idx, NAME);
+  return *ud;
+}
+
+template<typename T>
+int lua_util::typed_array<T>::lua_new(lua_State *L) {
+  const bool from_table = !lua_isinteger(L, 1);
+  if (from_table) luaL_checktype(L, 1, LUA_TTABLE);
+  const auto size = from_table ? (lua_Integer)lua_rawlen(L, 1) : lua_tointeger(L, 1);
+  if (size < 0) return luaL_argerror(L, 1, "negative size");
+  if ((lua_Unsigned)size > PTRDIFF_MAX / sizeof(T)) return luaL_argerror(L, 1, "size too large");
+
+  // 先压入 userdata, 转换元素出错时由 __gc 释放; 分配失败在 catch 外报错, 此时没有存活的 C++ 对象
+  auto &array = *new_array<T>(L);
+  bool allocated = true;
+  try {
+    array = typed_array((size_t)size);
+  } catch (const std::bad_alloc&) {
+    allocated = false;
+  }
+  if (!allocated) return luaL_error(L, "not enough memory for a %s array of %I elements", NAME, size);
+  if (!from_table) return 1;
+
+  for (size_t i = 0; i < (size_t)size; i++) {
+    lua_rawgeti(L, 1, (lua_Integer)i + 1);
+    int valid = 0;
+    if constexpr (std::is_floating_point_v<T>) {
+      array.data()[i] = (T)lua_tonumberx(L, -1, &valid);
+    } else {
+      const auto value = lua_tointegerx(L, -1, &valid);
+      if (valid && !fits<T>(value)) return luaL_error(L, "element #%d out of range", (int)(i + 1));
+      array.data()[i] = (T)value;
+    }
+    if (!valid) return luaL_error(L, "element #%d must be a %s", (int)(i + 1), std::is_floating_point_v<T> ? "number" : "integer");
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+template class lua_util::typed_array<float>;
+template class lua_util::typed_array<double>;
+template class lua_util::typed_array<int32_t>;
+template class lua_util::typed_array<int64_t>;
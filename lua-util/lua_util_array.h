@@ -0,0 +1,95 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <span>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+
+#include "lua_util_args.hpp"
+
+namespace lua_util {
+
+/// typed array
+/// a contiguous numeric array userdata for batch math in scripts: one method
+/// call runs a C++ loop over the whole array instead of one interpreter step per
+/// element. an array is a view plus the owner keeping its memory alive, so C++
+/// buffers are exposed without a copy and views passed back to C++ share them.
+/// element indices are 1 based, index arrays (i32/i64) hold 1 based indices.
+/// lua:
+///   a[i], a[i] = v, #a
+///   a:add(b)          a[i] = a[i] + b[i], b an array of the same type or a number
+///   a:mul(b)          a[i] = a[i] * b[i]
+///   a:fma(b, c)       a[i] = a[i] + b[i] * c[i], b and c arrays or numbers
+///   a:sum() a:min() a:max() a:dot(b)
+///   a:gather(src, idx)    a[i] = src[idx[i]]
+///   a:scatter(dst, idx)   dst[idx[i]] = a[i]
+///   a:fill(v)
+/// integer arithmetic wraps, min and max of an empty array are nil.
+/// @tparam T: float, double, int32_t or int64_t
+template<typename T>
+class typed_array {
+public:
+  static_assert(std::is_same_v<T, float> || std::is_same_v<T, double> ||
+    std::is_same_v<T, int32_t> || std::is_same_v<T, int64_t>, "unsupport type");
+
+  using value_type = T;
+
+  static constexpr const char* NAME =
+    std::is_same_v<T, float> ? "f32" : std::is_same_v<T, double> ? "f64" : std::is_same_v<T, int32_t> ? "i32" : "i64";
+  static constexpr const char* METATABLE =
+    std::is_same_v<T, float> ? "lua_util.f32_array" : std::is_same_v<T, double> ? "lua_util.f64_array" :
+    std::is_same_v<T, int32_t> ? "lua_util.i32_array" : "lua_util.i64_array";
+
+public:
+  typed_array() = default;
+
+  /// a zero filled array owning its memory
+  /// @param size: the element count
+  explicit typed_array(size_t size);
+
+  /// a view of existing memory, no copy
+  /// @param data: the elements, kept alive by owner
+  /// @param owner: owns the elements, may be null if they outlive every use of the view
+  typed_array(std::span<T> data, std::shared_ptr<const void> owner)
+    : _owner(std::move(owner)), _data(data) {}
+
+  inline std::span<T> data() const { return _data; }
+  inline size_t size() const { return _data.size(); }
+  inline const std::shared_ptr<const void> &owner() const { return _owner; }
+
+  /// push the array as a userdata sharing its memory
+  static void push(lua_State *L, const typed_array &array);
+
+  /// get the array at idx
+  /// @return the array, raises a lua error if the value is not an array of T
+  static typed_array check(lua_State *L, int idx);
+
+  /// lua: new(size | table) -> array
+  /// a size above PTRDIFF_MAX / sizeof(T) is an argument error, a failed allocation a lua error
+  static int lua_new(lua_State *L);
+
+private:
+  std::shared_ptr<const void> _owner;
+  std::span<T> _data;
+};
+
+using f32_array = typed_array<float>;
+using f64_array = typed_array<double>;
+using i32_array = typed_array<int32_t>;
+using i64_array = typed_array<int64_t>;
+
+extern template class typed_array<float>;
+extern template class typed_array<double>;
+extern template class typed_array<int32_t>;
+extern template class typed_array<int64_t>;
+
+template<typename T>
+struct arg<typed_array<T>> {
+  static typed_array<T> get(lua_State* L, int idx) { return typed_array<T>::check(L, idx); }
+
+  static inline void push(lua_State* L, const typed_array<T>& value) { typed_array<T>::push(L, value); }
+};
+
+}
@@ -0,0 +1,161 @@
+#include <bit>
+#include <new>
+#include <type_traits>
+
+#include "lua_util_chunk.h"
+#include "lua_util_bytes.h"
+
+using bytes = lua_util::bytes;
+
+namespace {
+
+/// the address of TAG starts every view, a type check is one compare
+const char TAG = 0;
+
+struct bytes_ref {
+  const void* tag;
+  std::shared_ptr<const void> owner;
+  std::span<const uint8_t> data;
+};
+
+template<size_t N> struct unsigned_of;
+template<> struct unsigned_of<1> { using type = uint8_t; };
+template<> struct unsigned_of<2> { using type = uint16_t; };
+template<> struct unsigned_of<4> { using type = uint32_t; };
+template<> struct unsigned_of<8> { using type = uint64_t; };
+
+}
+
+/// a 1 based position relative to size, negative counts from the end (string.sub)
+static lua_Integer relative(lua_Integer pos, size_t size) {
+  if (pos >= 0) return pos;
+  // 先比较再取负, -LUA_MININTEGER 会溢出
+  if (pos < -(lua_Integer)size) return 0;
+  return (lua_Integer)size + pos + 1;
+}
+
+/// the view at idx, raises a lua error if the value is not a view
+static bytes_ref& check_view(lua_State *L, int idx) {
+  auto* ref = (bytes_ref*)lua_touserdata(L, idx);
+  if (!ref || lua_rawlen(L, idx) != sizeof(bytes_ref) || ref->tag != &TAG)
+    luaL_argerror(L, idx, "bytes expected");
+  return *ref;
+}
+
+/// read a T at the 1 based offset of argument 2
+template<typename T, bool BIG>
+static int read_value(lua_State *L) {
+  using U = typename unsigned_of<sizeof(T)>::type;
+  const auto data = check_view(L, 1).data;
+  const auto pos = luaL_optinteger(L, 2, 1);
+  if (pos < 1 || (lua_Unsigned)pos > data.size() || data.size() - (size_t)(pos - 1) < sizeof(T))
+    return luaL_argerror(L, 2, "out of range");
+
+  auto raw = lua_util::read_bytes<U>(data, (size_t)(pos - 1));
+  if constexpr (BIG) raw = lua_util::detail::byteswap(raw);
+  const auto value = std::bit_cast<T>(raw);
+  if constexpr (std::is_floating_point_v<T>) lua_pushnumber(L, (lua_Number)value);
+  else lua_pushinteger(L, (lua_Integer)value);
+  return 1;
+}
+
+/// the [i, j] argument range clamped to data, string.sub rules
+static std::span<const uint8_t> range(lua_State *L, std::span<const uint8_t> data) {
+  auto i = relative(luaL_optinteger(L, 2, 1), data.size());
+  auto j = relative(luaL_optinteger(L, 3, -1), data.size());
+  if (i < 1) i = 1;
+  if ((lua_Unsigned)j > data.size()) j = (lua_Integer)data.size();
+  if (i > j) return {};
+  return data.subspan((size_t)(i - 1), (size_t)(j - i + 1));
+}
+
+static int bytes_sub(lua_State *L) {
+  const auto &ref = check_view(L, 1);
+  bytes::push(L, range(L, ref.data), ref.owner);
+  return 1;
+}
+
+static int bytes_string(lua_State *L) {
+  const auto data = range(L, check_view(L, 1).data);
+  lua_pushlstring(L, (const char*)data.data(), data.size());
+  return 1;
+}
+
+static int bytes_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)check_view(L, 1).data.size());
+  return 1;
+}
+
+static int bytes_tostring(lua_State *L) {
+  const auto data = check_view(L, 1).data;
+  lua_pushfstring(L, "bytes: %p (%I)", (const void*)data.data(), (lua_Integer)data.size());
+  return 1;
+}
+
+static int bytes_gc(lua_State *L) {
+  auto &ref = check_view(L, 1);
+  ref.~bytes_ref();
+  ref.tag = nullptr; // 手动调用 __gc 后不再可用
+  return 0;
+}
+
+void lua_util::bytes::push(lua_State *L, std::span<const uint8_t> data, std::shared_ptr<const void> owner) {
+  auto* ud = (bytes_ref*)lua_newuserdata(L, sizeof(bytes_ref));
+  new (ud) bytes_ref{ &TAG, std::move(owner), data };
+
+  if (luaL_newmetatable(L, METATABLE)) {
+    const luaL_Reg methods[] = {
+      { "u8", read_value<uint8_t, false> },
+      { "i8", read_value<int8_t, false> },
+      { "u16le", read_value<uint16_t, false> },
+      { "u32le", read_value<uint32_t, false> },
+      { "u64le", read_value<uint64_t, false> },
+      { "i16le", read_value<int16_t, false> },
+      { "i32le", read_value<int32_t, false> },
+      { "i64le", read_value<int64_t, false> },
+      { "f32le", read_value<float, false> },
+      { "f64le", read_value<double, false> },
+      { "u16be", read_value<uint16_t, true> },
+      { "u32be", read_value<uint32_t, true> },
+      { "u64be", read_value<uint64_t, true> },
+      { "i16be", read_value<int16_t, true> },
+      { "i32be", read_value<int32_t, true> },
+      { "i64be", read_value<int64_t, true> },
+      { "f32be", read_value<float, true> },
+      { "f64be", read_value<double, true> },
+      { "sub", bytes_sub },
+      { "string", bytes_string },
+    };
+    lua_createtable(L, 0, (int)std::size(methods));
+    for (const auto &[name, func] : methods) {
+      lua_pushcfunction(L, func);
+      lua_setfield(L, -2, name);
+    }
+    lua_setfield(L, -2, "__index");
+
+    const luaL_Reg metamethods[] = {
+      { "__len", bytes_len },
+      { "__tostring", bytes_tostring },
+      { "__gc", bytes_gc },
+    };
+    for (const auto &[name, func] : metamethods) {
+      lua_pushcfunction(L, func);
+      lua_setfield(L, -2, name);
+    }
+  }
+  lua_setmetatable(L, -2);
+}
+
+bool lua_util::bytes::push(lua_State *L, std::shared_ptr<const module_archive> archive, uint64_t id) {
+  const auto data = archive ? archive->chunks().get(id) : std::span<const uint8_t>();
+  if (data.empty()) {
+    lua_pushnil(L);
+    return false;
+  }
+  push(L, data, std::move(archive));
+  return true;
+}
+
+std::span<const uint8_t> lua_util::bytes::check(lua_State *L, int idx) {
+  return check_view(L, idx).data;
+}
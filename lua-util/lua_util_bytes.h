@@ -0,0 +1,50 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <span>
+#include <memory>
+#include <cstdint>
+
+namespace lua_util {
+
+class module_archive;
+
+/// bytes
+/// a read-only byte view userdata, e.g. over an archive chunk, so lua parsers
+/// read binary assets in place instead of through a copied and hashed string.
+/// the view holds its owner, sub-views share it. offsets are 1 based like
+/// string.sub and string.unpack.
+/// lua:
+///   #b                                        size in bytes
+///   b:u8(i) b:i8(i)                           one byte at i, i defaults to 1
+///   b:u16le(i) b:u32le(i) b:u64le(i) ...      unsigned, little endian
+///   b:i16be(i) b:i32be(i) b:i64be(i) ...      signed, big endian
+///   b:f32le(i) b:f64le(i) b:f32be(i) ...      floats
+///   b:sub(i, j)                               a view of [i, j], no copy
+///   b:string(i, j)                            a copy of [i, j] as a lua string
+/// u64 values above the lua integer range wrap like string.unpack("I8").
+class bytes {
+public:
+  static constexpr const char* METATABLE = "lua_util.bytes";
+
+public:
+  /// push a view
+  /// @param L: the lua state
+  /// @param data: the bytes, kept alive by owner
+  /// @param owner: owns the bytes, may be null if they outlive the state
+  static void push(lua_State *L, std::span<const uint8_t> data, std::shared_ptr<const void> owner);
+
+  /// push a view of an archive chunk, the archive is kept alive by the view
+  /// @param L: the lua state
+  /// @param archive: the archive
+  /// @param id: the chunk id
+  /// @return false if the chunk is missing, empty or fails verification, nil is pushed then
+  static bool push(lua_State *L, std::shared_ptr<const module_archive> archive, uint64_t id);
+
+  /// check that the value at idx is a bytes view
+  /// @return the bytes, raises a lua error if the value is not a view
+  static std::span<const uint8_t> check(lua_State *L, int idx);
+};
+
+}
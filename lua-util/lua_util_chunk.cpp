@@ -1,73 +1,330 @@
 #include <lua.hpp>
 
+#include <array>
 #include <fstream>
 #include <algorithm>
+#include <filesystem>
 #include <functional>
+#include <unordered_set>
 
 #include "lua_util_chunk.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+  #define LUA_UTIL_CRC32C_SSE42 1
+  #include <nmmintrin.h>
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #endif
+#elif defined(__ARM_FEATURE_CRC32)
+  #define LUA_UTIL_CRC32C_ARM 1
+  #include <arm_acle.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define LUA_UTIL_CHUNK_MMAP 1
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
 constexpr size_t SIGN_BIT = (size_t)1 << (sizeof(size_t)*8 - 1);
 
-std::unique_ptr<lua_util::id_tree> lua_util::id_tree::deserialize(size_t* nodes, size_t node_count) {
-  using ParseResult = std::pair<id_tree*, size_t>;
-  std::function<ParseResult(size_t*, size_t*)> parse = [&](size_t* begin, size_t* end) -> ParseResult {
-    if (begin >= end) return {nullptr, 0};
+constexpr size_t CHUNK_HEADER_SIZE = sizeof(uint64_t) * 2;   // [chunk_count] [flags]
+constexpr size_t CHUNK_ENTRY_SIZE = sizeof(uint64_t) * 3;    // [id] [offset] [size]
+constexpr size_t CHUNK_CRC_SIZE = sizeof(uint64_t);          // [crc], if FLAG_CRC32C
+constexpr size_t CHUNK_TRAILER_SIZE = sizeof(uint64_t) * 2;  // [header_offset] [magic]
+constexpr size_t LEGACY_ENTRY_SIZE = sizeof(uint64_t) * 2;   // [id] [size]
+
+using chunk_map = std::unordered_map<uint64_t, std::span<uint8_t>>;
+
+// 按 id 排序, 相同输入总是得到相同的 archive
+static std::vector<std::pair<uint64_t, std::span<uint8_t>>> sorted_chunks(const chunk_map &chunks) {
+  auto result = std::vector<std::pair<uint64_t, std::span<uint8_t>>>(chunks.begin(), chunks.end());
+  std::sort(result.begin(), result.end(),
+    [](const auto &a, const auto &b) { return a.first < b.first; });
+  return result;
+}
+
+// 内容相同的 chunk 只写入一次
+// 返回每个 chunk 的偏移, 以及实际写入的数据总大小
+class chunk_layout {
+public:
+  chunk_layout(uint64_t data_offset, bool deduplicate)
+    : _offset(data_offset), _deduplicate(deduplicate) {}
 
-    size_t id = *begin;
-    size_t* ptr = begin + 1;
+  /// place a chunk
+  /// @return the offset of the chunk and whether its bytes must be written
+  std::pair<uint64_t, bool> place(std::span<const uint8_t> data) {
+    if (!_deduplicate || data.empty()) return { advance(data.size()), true };
 
-    size_t child_count = 0;
+    auto &candidates = _placed[lua_util::hash_bytes(data)];
+    for (const auto &[offset, placed] : candidates) {
+      if (placed.size() == data.size() && std::memcmp(placed.data(), data.data(), data.size()) == 0)
+        return { offset, false };
+    }
+    const auto offset = advance(data.size());
+    candidates.emplace_back(offset, data);
+    return { offset, true };
+  }
+
+  inline uint64_t end() const { return _offset; }
+
+private:
+  uint64_t advance(uint64_t size) {
+    const auto offset = _offset;
+    _offset += size;
+    return offset;
+  }
+
+  uint64_t _offset;
+  bool _deduplicate;
+  std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, std::span<const uint8_t>>>> _placed;
+};
+
+// hot_order 中的 chunk 按首次出现的顺序排在最前, 其余按 id 排序
+static std::vector<std::pair<uint64_t, std::span<uint8_t>>> ordered_chunks(
+    const chunk_map &chunks, const std::vector<uint64_t> &hot_order, size_t &hot_count) {
+  auto result = std::vector<std::pair<uint64_t, std::span<uint8_t>>>();
+  result.reserve(chunks.size());
+
+  auto placed = std::unordered_set<uint64_t>();
+  for (const auto id : hot_order) {
+    const auto it = chunks.find(id);
+    if (it == chunks.end() || !placed.insert(id).second) continue;
+    result.emplace_back(*it);
+  }
+  hot_count = result.size();
+
+  for (const auto &item : sorted_chunks(chunks))
+    if (!placed.contains(item.first)) result.push_back(item);
+  return result;
+}
+
+static size_t chunk_header_size(size_t chunk_count, bool has_hot, bool checksum) {
+  const auto entry_size = CHUNK_ENTRY_SIZE + (checksum ? CHUNK_CRC_SIZE : 0);
+  return CHUNK_HEADER_SIZE + (has_hot ? sizeof(uint64_t) : 0) + chunk_count * entry_size;
+}
+
+// 写入 header, out 大小必须为 chunk_header_size(entries.size(), hot_size != 0, checksum)
+static void write_chunk_header(std::span<uint8_t> out, const std::vector<lua_util::chunk::entry> &entries,
+                               uint64_t hot_size, bool checksum) {
+  uint64_t flags = 0;
+  if (hot_size) flags |= lua_util::chunk::FLAG_HOT_SIZE;
+  if (checksum) flags |= lua_util::chunk::FLAG_CRC32C;
+
+  auto words = std::vector<uint64_t>();
+  words.reserve(3 + entries.size() * 4);
+  words.push_back(entries.size());
+  words.push_back(flags);
+  if (hot_size) words.push_back(hot_size);
+  for (const auto &e : entries) {
+    words.push_back(e.id);
+    words.push_back(e.offset);
+    words.push_back(e.size);
+    if (checksum) words.push_back(e.crc);
+  }
+  lua_util::to_bytes<uint64_t>(words, out);
+}
+
+static void write_chunk_trailer(std::span<uint8_t> out, uint64_t header_offset) {
+  const uint64_t words[] = { header_offset, lua_util::chunk::MAGIC };
+  lua_util::to_bytes<uint64_t>(words, out);
+}
+
+static void write_file(const std::string &path, std::span<const uint8_t> data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) throw std::runtime_error("failed to open file");
+  if (!file.write((const char*)data.data(), data.size()))
+    throw std::runtime_error("failed to write file");
+}
+
+uint64_t lua_util::hash_bytes(std::span<const uint8_t> data, uint64_t seed) {
+  constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+  constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+  constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+  const auto round = [](uint64_t acc, uint64_t word) {
+    return std::rotl(acc + word * P2, 31) * P1;
+  };
+
+  const size_t size = data.size();
+  uint64_t h = seed + P3 + size;
+  size_t i = 0;
+
+  // 四路独立累加, 每次处理 32 字节
+  if (size >= 32) {
+    uint64_t acc[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+    for (; i + 32 <= size; i += 32) {
+      for (size_t lane = 0; lane < 4; lane++)
+        acc[lane] = round(acc[lane], read_bytes<uint64_t>(data, i + lane * 8));
+    }
+    h = std::rotl(acc[0], 1) + std::rotl(acc[1], 7) + std::rotl(acc[2], 12) + std::rotl(acc[3], 18);
+    for (size_t lane = 0; lane < 4; lane++) h = (h ^ round(0, acc[lane])) * P1 + P3;
+    h += size;
+  }
+
+  for (; i + 8 <= size; i += 8) h = std::rotl(h ^ round(0, read_bytes<uint64_t>(data, i)), 27) * P1 + P3;
+  for (; i < size; i++) h = std::rotl(h ^ (data[i] * P3), 11) * P1;
+
+  // avalanche
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// crc32c 软件实现: slicing-by-8 查表
+static constexpr auto CRC32C_TABLE = [] {
+  std::array<std::array<uint32_t, 256>, 8> table = {};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (size_t t = 1; t < 8; t++)
+      table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+  return table;
+}();
+
+static uint32_t crc32c_portable(const uint8_t* data, size_t size, uint32_t crc) {
+  const auto &t = CRC32C_TABLE;
+  for (; size >= 8; size -= 8, data += 8) {
+    const auto lo = lua_util::read_bytes<uint32_t>({ data, 4 }) ^ crc;
+    const auto hi = lua_util::read_bytes<uint32_t>({ data + 4, 4 });
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; size; size--, data++) crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+  return crc;
+}
+
+#if LUA_UTIL_CRC32C_SSE42
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32c_hw(const uint8_t* data, size_t size, uint32_t crc) {
+  uint64_t crc64 = crc;
+  for (; size >= 8; size -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; size; size--, data++) crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+static bool crc32c_hw_supported() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif LUA_UTIL_CRC32C_ARM
+static uint32_t crc32c_hw(const uint8_t* data, size_t size, uint32_t crc) {
+  for (; size >= 8; size -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; size; size--, data++) crc = __crc32cb(crc, *data);
+  return crc;
+}
+
+static bool crc32c_hw_supported() { return true; }
+#endif
+
+uint32_t lua_util::crc32c(std::span<const uint8_t> data, uint32_t crc) {
+  crc = ~crc;
+#if LUA_UTIL_CRC32C_SSE42 || LUA_UTIL_CRC32C_ARM
+  static const bool hw = crc32c_hw_supported();
+  if (hw) return ~crc32c_hw(data.data(), data.size(), crc);
+#endif
+  return ~crc32c_portable(data.data(), data.size(), crc);
+}
+
+std::unique_ptr<lua_util::id_tree> lua_util::id_tree::deserialize(size_t* nodes, size_t node_count) {
+  size_t* ptr = nodes;
+  size_t* const end = nodes + node_count;
+
+  // 读取一个节点, 数据不足时返回 nullptr
+  const auto parse = [&](size_t &child_count) -> id_tree* {
+    if (ptr >= end) return nullptr;
+    const size_t id = *ptr++;
     size_t data = id_tree::NULL_DATA;
 
     // 根据最高位确定数据结构
     if (id & SIGN_BIT) {
-      if (ptr + 1 >= end) return {nullptr, 1}; // 数据不足
+      if (ptr + 1 >= end) return nullptr; // 数据不足
       data = *ptr++;
-      child_count = *ptr++;
-    } else {
-      if (ptr >= end) return {nullptr, 1}; // 数据不足
-      child_count = *ptr++;
-    }
+    } else if (ptr >= end) return nullptr; // 数据不足
+    child_count = *ptr++;
 
-    auto children = std::vector<id_tree*>(child_count);
-    size_t total_consumed = ptr - begin;
+    auto* n = new lua_util::id_tree(id & ~SIGN_BIT, data, {});
+    n->_children.reserve(std::min<size_t>(child_count, end - ptr));
+    return n;
+  };
 
-    // 递归解析子节点
-    for (size_t i = 0; i < child_count; ++i) {
-      size_t* new_pos = begin + total_consumed;
-      auto [child, consumed] = parse(new_pos, end);
-      if (!child) {
-        for (size_t j = 0; j < i; ++j) delete children[j];
-        return {nullptr, total_consumed + consumed};
-      }
-      children[i] = child;
-      total_consumed += consumed;
-    }
+  // serialize 已按 id 排序写入, 只有乱序时才排序
+  const auto finish = [](id_tree* n) {
+    const auto less = [](id_tree* a, id_tree* b) { return a->id() < b->id(); };
+    if (!std::is_sorted(n->_children.begin(), n->_children.end(), less))
+      std::sort(n->_children.begin(), n->_children.end(), less);
+  };
 
-    // 创建节点
-    id_tree* n = new lua_util::id_tree(id & ~SIGN_BIT, data, std::move(children));
+  // 显式栈代替递归, 深层树不会爆栈
+  size_t child_count = 0;
+  auto root = std::unique_ptr<id_tree>(parse(child_count));
+  if (!root) return nullptr;
 
-    // 排序节点
-    std::sort(n->_children.begin(), n->_children.end(),
-      [](id_tree* a, id_tree* b) { return a->id() < b->id(); });
-    return {n, total_consumed};
-  };
+  auto stack = std::vector<std::pair<id_tree*, size_t>>();
+  stack.emplace_back(root.get(), child_count);
+  while (!stack.empty()) {
+    auto &[node, remaining] = stack.back();
+    if (!remaining) {
+      finish(node);
+      stack.pop_back();
+      continue;
+    }
+
+    remaining--;
+    auto* child = parse(child_count);
+    if (!child) return nullptr;
+    node->_children.push_back(child);
+    stack.emplace_back(child, child_count);
+  }
 
-  // 解析节点
-  auto [root, consumed] = parse(nodes, nodes + node_count);
-  return (consumed == node_count) ? std::unique_ptr<id_tree>(root) : nullptr;
+  return (ptr == end) ? std::move(root) : nullptr;
 }
 
-void lua_util::id_tree::serialize(const id_tree& node, std::vector<size_t>& output) {
-  if (node._data != id_tree::NULL_DATA) {
-    output.push_back(node.id() | SIGN_BIT);
-    output.push_back(node._data);
-  } else output.push_back(node.id());
-  output.push_back(node._children.size());
+void lua_util::id_tree::serialize(const id_tree& tree, std::vector<size_t>& output) {
+  // 先序遍历, 显式栈代替递归
+  auto stack = std::vector<std::pair<const id_tree*, size_t>>();
+  stack.emplace_back(&tree, 0);
+  while (!stack.empty()) {
+    auto &[node, next] = stack.back();
+    if (next == 0) {
+      if (node->_data != id_tree::NULL_DATA) {
+        output.push_back(node->id() | SIGN_BIT);
+        output.push_back(node->_data);
+      } else output.push_back(node->id());
+      output.push_back(node->_children.size());
+    }
 
-  // 序列化子节点（已排序）
-  for (size_t i = 0; i < node._children.size(); ++i)
-    serialize(node.get_child(i), output);
+    // 序列化子节点（已排序）
+    if (next == node->_children.size()) {
+      stack.pop_back();
+      continue;
+    }
+    const auto* child = node->_children[next++];
+    stack.emplace_back(child, 0);
+  }
 }
 
 const int32_t lua_util::id_tree::find(size_t id) const {
@@ -126,9 +383,253 @@ lua_util::id_tree::id_tree(size_t id, size_t data, std::vector<id_tree*>&& child
   : _id(id), _data(data), _children(children) {}
 
 lua_util::id_tree::~id_tree() {
-  for (size_t i = 0; i < _children.size(); i++) {
-    auto child = _children[i];
-    if (child) delete child;
+  // 逐个释放后代节点, 深层树不会递归爆栈
+  auto pending = std::move(_children);
+  while (!pending.empty()) {
+    auto child = pending.back();
+    pending.pop_back();
+    if (!child) continue;
+    pending.insert(pending.end(), child->_children.begin(), child->_children.end());
+    child->_children.clear();
+    delete child;
+  }
+}
+
+// 广度优先展开, 同一节点的子节点连续存放
+static std::vector<const lua_util::id_tree*> breadth_first(const lua_util::id_tree &tree) {
+  auto order = std::vector<const lua_util::id_tree*>();
+  order.push_back(&tree);
+  for (size_t i = 0; i < order.size(); i++) {
+    const auto &node = *order[i];
+    for (int32_t c = 0; node.valid_idx(c); c++) order.push_back(&node.get_child(c));
+  }
+  if (order.size() > (size_t)INT32_MAX)
+    throw std::length_error("id tree too large");
+  return order;
+}
+
+lua_util::frozen_id_tree::frozen_id_tree(const id_tree &tree) {
+  const auto order = breadth_first(tree);
+
+  // 一次分配: ids 与 data 各占 n 个 uint64, first_child 与 child_count 共占 n 个 uint64
+  _size = order.size();
+  _buffer = std::make_unique<uint64_t[]>(_size * 3);
+  auto* ids = _buffer.get();
+  auto* data = ids + _size;
+  auto* first_child = (uint32_t*)(data + _size);
+  auto* child_count = first_child + _size;
+
+  uint32_t next = 1;
+  for (size_t i = 0; i < _size; i++) {
+    const auto* node = order[i];
+    ids[i] = node->_id;
+    data[i] = node->_data;
+    first_child[i] = next;
+    child_count[i] = (uint32_t)node->_children.size();
+    next += child_count[i];
+  }
+
+  _ids = ids;
+  _data = data;
+  _first_child = first_child;
+  _child_count = child_count;
+}
+
+void lua_util::id_tree_view::serialize(const id_tree &tree, std::vector<uint8_t> &output) {
+  const auto order = breadth_first(tree);
+  const uint32_t node_count = (uint32_t)order.size();
+
+  auto ids = std::vector<uint64_t>(node_count);
+  auto data = std::vector<uint64_t>(node_count);
+  auto links = std::vector<uint32_t>(node_count * 2); // [first_child] [child_count]
+  uint32_t next = 1;
+  for (uint32_t i = 0; i < node_count; i++) {
+    const auto* node = order[i];
+    ids[i] = node->_id;
+    data[i] = node->_data;
+    links[i] = next;
+    links[node_count + i] = (uint32_t)node->_children.size();
+    next += links[node_count + i];
+  }
+
+  const auto offset = output.size();
+  output.resize(offset + HEADER_SIZE + node_count * NODE_SIZE);
+  auto sp = std::span<uint8_t>(output).subspan(offset);
+  write_bytes(sp, MAGIC, 0);
+  write_bytes(sp, node_count, sizeof(uint32_t));
+  sp = sp.subspan(HEADER_SIZE);
+  to_bytes<uint64_t>(ids, sp);
+  to_bytes<uint64_t>(data, sp.subspan(node_count * sizeof(uint64_t)));
+  to_bytes<uint32_t>(links, sp.subspan(node_count * sizeof(uint64_t) * 2));
+}
+
+lua_util::id_tree_view::id_tree_view(std::span<const uint8_t> buffer) {
+  if (buffer.size() < HEADER_SIZE || read_bytes<uint32_t>(buffer, 0) != MAGIC)
+    throw std::runtime_error("invalid id tree: bad header");
+
+  const auto node_count = read_bytes<uint32_t>(buffer, sizeof(uint32_t));
+  if (node_count > (buffer.size() - HEADER_SIZE) / NODE_SIZE || node_count > (uint32_t)INT32_MAX)
+    throw std::runtime_error("invalid id tree: truncated");
+
+  _size = node_count;
+  _nodes = buffer.subspan(HEADER_SIZE, node_count * NODE_SIZE);
+}
+
+lua_util::detail::perfect_hash lua_util::detail::perfect_hash::build(const std::vector<std::string_view> &keys) {
+  constexpr uint32_t MAX_SEEDS = 64;
+  constexpr uint32_t MAX_DISPLACEMENT = 1 << 22;
+
+  const auto key_count = (uint32_t)keys.size();
+  if (keys.size() > UINT32_MAX / 2) throw std::length_error("too many keys");
+
+  auto result = perfect_hash();
+  if (!key_count) return result;
+
+  const auto bucket_count = (key_count + 3) / 4;
+  auto hashes = std::vector<uint64_t>(key_count);
+  auto taken = std::vector<uint8_t>(key_count);
+  auto positions = std::vector<uint32_t>();
+
+  for (uint32_t seed = 0; seed < MAX_SEEDS; seed++) {
+    for (uint32_t i = 0; i < key_count; i++)
+      hashes[i] = hash_bytes({ (const uint8_t*)keys[i].data(), keys[i].size() }, seed);
+
+    // 哈希值重复时换一个种子
+    auto sorted = hashes;
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) continue;
+
+    // 分桶, 从大桶开始放置
+    auto buckets = std::vector<std::vector<uint32_t>>(bucket_count);
+    for (uint32_t i = 0; i < key_count; i++) buckets[bucket(hashes[i], bucket_count)].push_back(i);
+    auto order = std::vector<uint32_t>(bucket_count);
+    for (uint32_t i = 0; i < bucket_count; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+      [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    result.seed = seed;
+    result.displacements.assign(bucket_count, 0);
+    result.slots.assign(key_count, 0);
+    std::fill(taken.begin(), taken.end(), 0);
+
+    bool ok = true;
+    for (const auto b : order) {
+      const auto &members = buckets[b];
+      if (members.empty()) break;
+
+      bool placed = false;
+      for (uint32_t d = 0; d < MAX_DISPLACEMENT && !placed; d++) {
+        positions.clear();
+        placed = true;
+        for (const auto key : members) {
+          const auto pos = slot(hashes[key], d, key_count);
+          if (taken[pos] || std::find(positions.begin(), positions.end(), pos) != positions.end()) {
+            placed = false;
+            break;
+          }
+          positions.push_back(pos);
+        }
+        if (!placed) continue;
+
+        result.displacements[b] = d;
+        for (size_t i = 0; i < members.size(); i++) {
+          taken[positions[i]] = 1;
+          result.slots[members[i]] = positions[i];
+        }
+      }
+      if (!placed) {
+        ok = false;
+        break;
+      }
+    }
+    if (ok) return result;
+  }
+  throw std::runtime_error("failed to build perfect hash");
+}
+
+std::vector<uint8_t> lua_util::module_index::build(const std::unordered_map<std::string, uint64_t> &modules) {
+  auto keys = std::vector<std::string_view>();
+  keys.reserve(modules.size());
+  for (const auto &[path, id] : modules) keys.push_back(path);
+  const auto ph = detail::perfect_hash::build(keys);
+
+  const auto key_count = (uint32_t)keys.size();
+  const auto bucket_count = (uint32_t)ph.displacements.size();
+  size_t names_size = 0;
+  for (const auto &key : keys) names_size += key.size();
+  if (names_size > UINT32_MAX) throw std::length_error("module paths too long");
+
+  // 按槽位写入, 名字按槽位顺序排列
+  auto by_slot = std::vector<uint32_t>(key_count);
+  for (uint32_t i = 0; i < key_count; i++) by_slot[ph.slots[i]] = i;
+
+  const size_t slots_offset = HEADER_SIZE + bucket_count * sizeof(uint32_t);
+  const size_t names_offset = slots_offset + key_count * SLOT_SIZE;
+  auto result = std::vector<uint8_t>(names_offset + names_size);
+  const auto sp = std::span<uint8_t>(result);
+
+  const uint32_t header[] = { MAGIC, key_count, bucket_count, ph.seed };
+  to_bytes<uint32_t>(header, sp);
+  to_bytes<uint32_t>(ph.displacements, sp.subspan(HEADER_SIZE));
+
+  uint32_t name_offset = 0;
+  for (uint32_t s = 0; s < key_count; s++) {
+    const auto &key = keys[by_slot[s]];
+    const auto offset = slots_offset + s * SLOT_SIZE;
+    write_bytes(sp, (uint64_t)modules.find(std::string(key))->second, offset);
+    write_bytes(sp, name_offset, offset + sizeof(uint64_t));
+    write_bytes(sp, (uint32_t)key.size(), offset + sizeof(uint64_t) + sizeof(uint32_t));
+    if (!key.empty()) std::memcpy(result.data() + names_offset + name_offset, key.data(), key.size());
+    name_offset += (uint32_t)key.size();
+  }
+  return result;
+}
+
+lua_util::module_index::module_index(std::span<const uint8_t> buffer) {
+  if (buffer.size() < HEADER_SIZE || read_bytes<uint32_t>(buffer, 0) != MAGIC)
+    throw std::runtime_error("invalid module index: bad header");
+
+  _key_count = read_bytes<uint32_t>(buffer, sizeof(uint32_t));
+  _bucket_count = read_bytes<uint32_t>(buffer, sizeof(uint32_t) * 2);
+  _seed = read_bytes<uint32_t>(buffer, sizeof(uint32_t) * 3);
+
+  const size_t slots_offset = HEADER_SIZE + (size_t)_bucket_count * sizeof(uint32_t);
+  const size_t names_offset = slots_offset + (size_t)_key_count * SLOT_SIZE;
+  if (names_offset > buffer.size() || (_key_count && !_bucket_count))
+    throw std::runtime_error("invalid module index: truncated");
+
+  _displacements = buffer.subspan(HEADER_SIZE, slots_offset - HEADER_SIZE);
+  _slots = buffer.subspan(slots_offset, names_offset - slots_offset);
+  _names = buffer.subspan(names_offset);
+}
+
+uint64_t lua_util::module_index::find(std::string_view path) const {
+  if (!_key_count) return NULL_ID;
+
+  const auto hash = hash_bytes({ (const uint8_t*)path.data(), path.size() }, _seed);
+  const auto bucket = detail::perfect_hash::bucket(hash, _bucket_count);
+  const auto displacement = read_bytes<uint32_t>(_displacements, bucket * sizeof(uint32_t));
+  const auto slot = detail::perfect_hash::slot(hash, displacement, _key_count);
+
+  // 校验名字, 不在索引中的路径也会落到某个槽位
+  const auto offset = slot * SLOT_SIZE;
+  const auto name_offset = read_bytes<uint32_t>(_slots, offset + sizeof(uint64_t));
+  const auto name_size = read_bytes<uint32_t>(_slots, offset + sizeof(uint64_t) + sizeof(uint32_t));
+  if (name_size != path.size() || name_offset > _names.size() || name_size > _names.size() - name_offset)
+    return NULL_ID;
+  if (name_size && std::memcmp(_names.data() + name_offset, path.data(), name_size) != 0)
+    return NULL_ID;
+  return read_bytes<uint64_t>(_slots, offset);
+}
+
+void lua_util::module_index::for_each(
+    const std::function<void(std::string_view path, uint64_t chunk_id)> &func) const {
+  for (uint32_t s = 0; s < _key_count; s++) {
+    const auto offset = s * SLOT_SIZE;
+    const auto name_offset = read_bytes<uint32_t>(_slots, offset + sizeof(uint64_t));
+    const auto name_size = read_bytes<uint32_t>(_slots, offset + sizeof(uint64_t) + sizeof(uint32_t));
+    if (name_offset > _names.size() || name_size > _names.size() - name_offset) continue;
+    func({ (const char*)_names.data() + name_offset, name_size }, read_bytes<uint64_t>(_slots, offset));
   }
 }
 
@@ -141,7 +642,14 @@ void lua_util::path_part_collection::add_part(const std::string_view &path_part,
   if (path_part.find('/') != path_part.npos ||
       path_part.find('\\') != path_part.npos)
     throw std::runtime_error("invalid path: contains separator");
-  _map[path_part] = id;
+  auto it = _map.find(path_part);
+  if (it != _map.end()) {
+    if (auto old = _parts.find(it->second); old != _parts.end() && old->second == path_part) _parts.erase(old);
+    it->second = id;
+  } else {
+    it = _map.emplace(std::string(path_part), id).first;
+  }
+  _parts[id] = it->first;
 }
 
 std::vector<size_t>
@@ -166,110 +674,434 @@ lua_util::path_part_collection::to_ids(const std::string_view &path) const {
 void lua_util::id_tree::for_each_child(
     const std::function<void(const id_tree &children)> &func) const {
   func(*this);
-  for (size_t i = 0; i < _children.size(); i++)
-    for_each_child(func);
+  for_each_descendant([&](std::span<const size_t>, const id_tree &node) { func(node); });
 }
 
-lua_util::chunk::chunk(): _buffer(nullptr), _buffer_size(0) {}
+void lua_util::id_tree::for_each_descendant(
+    const std::function<void(std::span<const size_t> ids, const id_tree &node)> &func) const {
+  // 显式栈: 每层记录节点和下一个要访问的子节点
+  auto stack = std::vector<std::pair<const id_tree*, size_t>>();
+  auto ids = std::vector<size_t>();
+  stack.emplace_back(this, 0);
+  while (!stack.empty()) {
+    auto &[node, next] = stack.back();
+    if (next == node->_children.size()) {
+      stack.pop_back();
+      if (!ids.empty()) ids.pop_back();
+      continue;
+    }
+
+    const auto* child = node->_children[next++];
+    ids.push_back(child->_id);
+    func(ids, *child);
+    stack.emplace_back(child, 0);
+  }
+}
+
+lua_util::chunk::chunk(): _buffer(nullptr), _buffer_size(0), _dead_size(0), _hot_size(0), _storage(storage::owned), _checksum(false) {}
 
 lua_util::chunk::chunk(const std::string_view &filename): chunk() {
-  std::ifstream file(filename.data(), std::ios::binary | std::ios::ate);
+  const auto path = std::string(filename);
+
+#if LUA_UTIL_CHUNK_MMAP
+  // 私有映射: 页面在进程间共享, 写入时才复制
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("failed to open file");
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error("failed to read file");
+  }
+  _buffer_size = st.st_size;
+  if (!_buffer_size) {
+    ::close(fd);
+    return;
+  }
+
+  void* addr = ::mmap(nullptr, _buffer_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    _buffer_size = 0;
+    throw std::runtime_error("failed to map file");
+  }
+  _buffer = (uint8_t*)addr;
+  _storage = storage::mapped;
+  build_buffer_map_or_release();
+  prefetch_hot();
+  return;
+#else
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
   if (!file.is_open()) throw std::runtime_error("failed to open file");
   _buffer_size = file.tellg();
   file.seekg(0, std::ios::beg);
   if (!_buffer_size) return;
 
-  _buffer = new uint8_t[_buffer_size];
+  auto* buffer = new uint8_t[_buffer_size];
+  _buffer = buffer;
 
-  if (!file.read((char*)_buffer, _buffer_size))
+  if (!file.read((char*)buffer, _buffer_size)) {
+    release();
     throw std::runtime_error("failed to read file");
+  }
+#endif
 
-  build_buffer_map();
+  build_buffer_map_or_release();
 }
 
 lua_util::chunk::chunk(uint8_t *buffer, size_t buffer_size) {
   _buffer = buffer;
   _buffer_size = buffer_size;
+  _dead_size = 0;
+  _hot_size = 0;
+  _storage = storage::owned;
+  _checksum = false;
   build_buffer_map();
 }
 
 lua_util::chunk::chunk(const std::span<uint8_t> &buffer) {
   _buffer = buffer.data();
   _buffer_size = buffer.size();
+  _dead_size = 0;
+  _hot_size = 0;
+  _storage = storage::owned;
+  _checksum = false;
   build_buffer_map();
 }
 
 lua_util::chunk::chunk(chunk&& other) {
   _buffer = other._buffer;
   _buffer_size = other._buffer_size;
+  _dead_size = other._dead_size;
+  _hot_size = other._hot_size;
+  _storage = other._storage;
+  _checksum = other._checksum;
   _data_map = std::move(other._data_map);
+  _entries = other._entries;
+  _verify_bits = std::move(other._verify_bits);
 
   other._buffer = nullptr;
   other._buffer_size = 0;
+  other._dead_size = 0;
+  other._hot_size = 0;
+  other._checksum = false;
   other._data_map = {};
+  other._entries = {};
 }
 
 lua_util::chunk &lua_util::chunk::operator=(chunk &&other) {
+  if (this == &other) return *this;
+  release();
+
   _buffer = other._buffer;
   _buffer_size = other._buffer_size;
+  _dead_size = other._dead_size;
+  _hot_size = other._hot_size;
+  _storage = other._storage;
+  _checksum = other._checksum;
   _data_map = std::move(other._data_map);
+  _entries = other._entries;
+  _verify_bits = std::move(other._verify_bits);
 
   other._buffer = nullptr;
   other._buffer_size = 0;
+  other._dead_size = 0;
+  other._hot_size = 0;
+  other._checksum = false;
   other._data_map = {};
+  other._entries = {};
   return *this;
 }
 
 lua_util::chunk::~chunk() {
-  if (!_buffer) return;
+  release();
+}
 
+void lua_util::chunk::release() {
   _data_map = {};
+  _entries = {};
+  _verify_bits = nullptr;
+  _checksum = false;
+  if (!_buffer) return;
+
+#if LUA_UTIL_CHUNK_MMAP
+  if (_storage == storage::mapped) ::munmap((void*)_buffer, _buffer_size);
+#endif
+  if (_storage == storage::owned) delete[] _buffer;
+  _buffer = nullptr;
   _buffer_size = 0;
-  if (_buffer) delete[] _buffer;
+  _dead_size = 0;
+  _hot_size = 0;
 }
 
-void lua_util::chunk::build_buffer_map() {
-  if (!_buffer || !_buffer_size) return;
+void lua_util::chunk::for_each(
+    const std::function<void(size_t id, std::span<const uint8_t> data)> &func) const {
+  for (const auto &e : _entries) func(e.id, { _buffer + e.offset, e.size });
+  for (const auto &[id, s] : _data_map) func(id, s.data);
+}
 
-  // read header
-  const auto sp = std::span<uint8_t>(_buffer, _buffer_size);
-  auto chunk_count = read_bytes<uint64_t>(sp, 0);
-  auto header = std::vector<std::pair<uint64_t, uint64_t>>();
+std::span<const uint8_t> lua_util::chunk::verify(const slot &s) const {
+  // 多个线程可能同时校验同一个 chunk, 结果相同, 无需加锁
+  const auto state = crc32c(s.data) == s.crc ? VERIFIED : CORRUPTED;
+  _verify_bits[s.index / 32].fetch_or(state << (s.index % 32 * 2), std::memory_order_relaxed);
+  return state == VERIFIED ? s.data : std::span<const uint8_t>();
+}
+
+lua_util::chunk_stack::chunk_stack(chunk &&base) {
+  push(std::move(base));
+}
+
+lua_util::chunk_stack::chunk_stack(std::vector<chunk> &&layers) {
+  _layers.reserve(layers.size());
+  for (auto &layer : layers) push(std::move(layer));
+  layers.clear();
+}
+
+void lua_util::chunk_stack::push(chunk &&layer) {
+  const auto layer_idx = (uint32_t)_layers.size();
+  _data_map.reserve(_data_map.size() + layer.size());
+  for (uint32_t i = 0; i < layer._entries.size(); i++) {
+    const auto &e = layer._entries[i];
+    _data_map[e.id] = { layer_idx, { { layer._buffer + e.offset, e.size }, e.crc, i } };
+  }
+  for (const auto &[id, s] : layer._data_map) _data_map[id] = { layer_idx, s };
+  _layers.push_back(std::move(layer));
+}
+
+std::vector<lua_util::chunk> lua_util::chunk_stack::release() {
+  auto layers = std::move(_layers);
+  _layers.clear();
+  _data_map.clear();
+  return layers;
+}
+
+using read_func = std::function<void(uint64_t offset, std::span<uint8_t> out)>;
+
+// 按索引格式读取 header, trailer 位于 archive_end 之前
+static lua_util::chunk::header read_indexed_header(const read_func &read, uint64_t header_offset, uint64_t archive_end) {
+  using chunk = lua_util::chunk;
+  auto result = chunk::header();
+  uint8_t words[CHUNK_TRAILER_SIZE];
+
+  const auto header_end = archive_end - CHUNK_TRAILER_SIZE;
+  if (header_offset > header_end - CHUNK_HEADER_SIZE)
+    throw std::runtime_error("invalid chunk: header out of range");
+  read(header_offset, { words, CHUNK_HEADER_SIZE });
+  const auto chunk_count = lua_util::read_bytes<uint64_t>(words, 0);
+  const auto flags = lua_util::read_bytes<uint64_t>(words, sizeof(uint64_t));
+  if (flags & ~(chunk::FLAG_HOT_SIZE | chunk::FLAG_CRC32C)) throw std::runtime_error("invalid chunk: unsupported flags");
+  result.checksum = flags & chunk::FLAG_CRC32C;
+  const size_t entry_words = result.checksum ? 4 : 3;
+  const size_t entry_size = entry_words * sizeof(uint64_t);
+
+  auto entries_offset = header_offset + CHUNK_HEADER_SIZE;
+  if (flags & chunk::FLAG_HOT_SIZE) {
+    if (entries_offset + sizeof(uint64_t) > header_end)
+      throw std::runtime_error("invalid chunk: header out of range");
+    read(entries_offset, { words, sizeof(uint64_t) });
+    result.hot_size = std::min(lua_util::read_bytes<uint64_t>(words, 0), archive_end);
+    entries_offset += sizeof(uint64_t);
+  }
+
+  if (chunk_count > (header_end - entries_offset) / entry_size)
+    throw std::runtime_error("invalid chunk: header out of range");
+
+  auto bytes = std::vector<uint8_t>(chunk_count * entry_size);
+  auto values = std::vector<uint64_t>(chunk_count * entry_words);
+  read(entries_offset, bytes);
+  lua_util::from_bytes<uint64_t>(bytes, values);
+
+  result.entries.resize(chunk_count);
   for (size_t i = 0; i < chunk_count; i++) {
-    const auto offset = sizeof(uint64_t) + i * sizeof(uint64_t) * 2;
-    const auto id = read_bytes<uint64_t>(sp, offset);
-    const auto size = read_bytes<uint64_t>(sp, offset + sizeof(uint64_t));
-    header.emplace_back(id, size);
+    const auto *w = &values[i * entry_words];
+    result.entries[i] = { w[0], w[1], w[2], result.checksum ? (uint32_t)w[3] : 0 };
+  }
+  result.size = entries_offset - header_offset + bytes.size() + CHUNK_TRAILER_SIZE;
+
+  for (const auto &e : result.entries) {
+    if (e.offset > header_end || e.size > header_end - e.offset)
+      throw std::runtime_error("invalid chunk: entry out of range");
   }
+  return result;
+}
+
+// 旧格式: [count] [id size] * count, 数据紧跟 header 顺序排列
+// @param exact: 要求数据恰好结束于文件末尾
+static bool read_legacy_header(const read_func &read, uint64_t total_size, bool exact, lua_util::chunk::header &result) {
+  uint8_t word[sizeof(uint64_t)];
+  read(0, word);
+  const auto chunk_count = lua_util::read_bytes<uint64_t>(word, 0);
+  if (chunk_count > (total_size - sizeof(uint64_t)) / LEGACY_ENTRY_SIZE) return false;
+
+  auto bytes = std::vector<uint8_t>(chunk_count * LEGACY_ENTRY_SIZE);
+  auto values = std::vector<uint64_t>(chunk_count * 2);
+  read(sizeof(uint64_t), bytes);
+  lua_util::from_bytes<uint64_t>(bytes, values);
 
-  // build map
-  const auto chunk_offset = sizeof(uint64_t) + chunk_count * sizeof(uint64_t) * 2;
-  auto offset = chunk_offset;
+  uint64_t offset = sizeof(uint64_t) + chunk_count * LEGACY_ENTRY_SIZE;
+  result.entries.resize(chunk_count);
   for (size_t i = 0; i < chunk_count; i++) {
-    const auto [id, size] = header[i];
-    _data_map[id] = std::span<uint8_t>(_buffer + offset, size);
-    offset += size;
+    result.entries[i] = { values[i * 2], offset, values[i * 2 + 1] };
+    offset += std::min(result.entries[i].size, total_size);
   }
+  result.size = sizeof(uint64_t) + bytes.size();
+  return !exact || offset == total_size;
 }
 
-std::vector<uint8_t> lua_util::chunk::build_chunk_buffer(
-    std::unordered_map<uint64_t, std::span<uint8_t>> &chunks) {
-  // write header
-  const uint64_t chunk_count = chunks.size();
-  auto result = std::vector<uint8_t>();
+// 从末尾向前查找最后一个完整的 trailer, 用于恢复追加写入中断的文件
+// @return the end of the recovered archive, 0 if none
+static uint64_t find_last_trailer(const read_func &read, uint64_t total_size, lua_util::chunk::header &result) {
+  constexpr size_t BLOCK_SIZE = 64 * 1024;
+  constexpr size_t MIN_ARCHIVE = CHUNK_HEADER_SIZE + CHUNK_TRAILER_SIZE;
+  if (total_size < MIN_ARCHIVE) return 0;
+
+  uint8_t magic[sizeof(uint64_t)];
+  lua_util::write_bytes(std::span<uint8_t>(magic), lua_util::chunk::MAGIC, 0);
+
+  // 块之间重叠 7 字节, 跨块的 magic 也能找到
+  auto block = std::vector<uint8_t>(BLOCK_SIZE + sizeof(uint64_t) - 1);
+  uint64_t block_end = total_size;
+  while (block_end > MIN_ARCHIVE - sizeof(uint64_t)) {
+    const uint64_t block_begin = block_end > BLOCK_SIZE ? block_end - BLOCK_SIZE : 0;
+    const uint64_t read_end = std::min<uint64_t>(total_size, block_end + sizeof(uint64_t) - 1);
+    const auto data = std::span<uint8_t>(block.data(), read_end - block_begin);
+    read(block_begin, data);
+
+    for (uint64_t pos = block_end; pos-- > block_begin;) {
+      // magic 位于 [pos, pos + 8), trailer 结束于 pos + 8
+      const auto end = pos + sizeof(uint64_t);
+      if (end > total_size || end < MIN_ARCHIVE) continue;
+      if (std::memcmp(data.data() + (pos - block_begin), magic, sizeof(magic)) != 0) continue;
+
+      uint8_t word[sizeof(uint64_t)];
+      read(end - CHUNK_TRAILER_SIZE, word);
+      try {
+        result = read_indexed_header(read, lua_util::read_bytes<uint64_t>(word, 0), end);
+        return end;
+      } catch (const std::runtime_error&) {
+        // 数据中恰好出现 magic, 继续向前查找
+      }
+    }
+    block_end = block_begin;
+  }
+  return 0;
+}
 
-  write_bytes(result, chunk_count);
-  for (auto [id, chunk] : chunks) {
-    write_bytes(result, (uint64_t)id);
-    write_bytes(result, (uint64_t)chunk.size());
+lua_util::chunk::header lua_util::chunk::read_header(const read_func &read, uint64_t total_size) {
+  auto result = header();
+  if (total_size < sizeof(uint64_t)) return result;
+
+  // 1. 末尾有 trailer 时按索引格式读取
+  if (total_size >= CHUNK_HEADER_SIZE + CHUNK_TRAILER_SIZE) {
+    uint8_t words[CHUNK_TRAILER_SIZE];
+    read(total_size - CHUNK_TRAILER_SIZE, words);
+    if (read_bytes<uint64_t>(words, sizeof(uint64_t)) == MAGIC)
+      return read_indexed_header(read, read_bytes<uint64_t>(words, 0), total_size);
   }
 
-  // write chunks
-  for (auto [id, chunk] : chunks)
-    result.insert(result.end(), chunk.begin(), chunk.end());
+  // 2. 完整的旧格式文件
+  if (read_legacy_header(read, total_size, true, result)) return result;
+
+  // 3. 追加写入中断, 末尾是不完整的数据: 回退到最后一次完整写入
+  if (find_last_trailer(read, total_size, result)) return result;
+
+  // 4. 按旧格式宽松读取
+  result = header();
+  if (!read_legacy_header(read, total_size, false, result))
+    throw std::runtime_error("invalid chunk: header out of range");
+  for (const auto &e : result.entries) {
+    if (e.offset > total_size || e.size > total_size - e.offset)
+      throw std::runtime_error("invalid chunk: entry out of range");
+  }
+  return result;
+}
+
+void lua_util::chunk::build_buffer_map() {
+  if (!_buffer || !_buffer_size) return;
+
+  const auto h = read_header([this](uint64_t offset, std::span<uint8_t> out) {
+    std::memcpy(out.data(), _buffer + offset, out.size());
+  }, _buffer_size);
+
+  build_data_map(h.entries, h.checksum, h.size);
+  _hot_size = h.hot_size;
+}
+
+void lua_util::chunk::build_buffer_map_or_release() {
+  // 构造函数抛出异常时析构函数不会执行, 在这里释放映射或缓冲区
+  try {
+    build_buffer_map();
+  } catch (...) {
+    release();
+    throw;
+  }
+}
+
+void lua_util::chunk::build_data_map(std::span<const entry> entries, bool checksum, uint64_t header_size) {
+  // build map, chunks sharing an offset are counted once
+  size_t live_size = 0;
+  auto live_offsets = std::unordered_set<uint64_t>();
+  _data_map.reserve(entries.size());
+  live_offsets.reserve(entries.size());
+  for (uint32_t i = 0; i < entries.size(); i++) {
+    const auto &e = entries[i];
+    _data_map[e.id] = { std::span<const uint8_t>(_buffer + e.offset, e.size), e.crc, i };
+    if (live_offsets.insert(e.offset).second) live_size += e.size;
+  }
+
+  init_verify_bits(entries.size(), checksum);
+  _dead_size = _buffer_size - std::min<size_t>(_buffer_size, live_size + header_size);
+}
+
+void lua_util::chunk::init_verify_bits(size_t count, bool checksum) {
+  // 校验延迟到首次 get, 这里只分配状态位
+  _checksum = checksum;
+  if (_checksum) {
+    const auto words = (count + 31) / 32;
+    _verify_bits = std::make_unique<std::atomic<uint64_t>[]>(words);
+    for (size_t i = 0; i < words; i++) _verify_bits[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+lua_util::chunk lua_util::chunk::borrow(std::span<const uint8_t> buffer) {
+  // 只读取, 不会写入或释放
+  auto result = chunk();
+  result._buffer = buffer.data();
+  result._buffer_size = buffer.size();
+  result._storage = storage::borrowed;
+  result.build_buffer_map();
   return result;
 }
 
+lua_util::chunk lua_util::chunk::borrow(std::span<const uint8_t> buffer, std::span<const entry> entries, bool checksum) {
+  for (size_t i = 0; i < entries.size(); i++) {
+    const auto &e = entries[i];
+    if (e.offset > buffer.size() || e.size > buffer.size() - e.offset)
+      throw std::runtime_error("invalid chunk entry: out of buffer");
+    if (i && entries[i - 1].id >= e.id)
+      throw std::runtime_error("invalid chunk entry: not sorted by id");
+  }
+
+  // 直接在 entries 上二分查找, 不建哈希表
+  auto result = chunk();
+  result._buffer = buffer.data();
+  result._buffer_size = buffer.size();
+  result._storage = storage::borrowed;
+  result._entries = entries;
+  result.init_verify_bits(entries.size(), checksum);
+  return result;
+}
+
+void lua_util::chunk::prefetch_hot() const {
+  if (!_buffer || !_hot_size) return;
+
+#if LUA_UTIL_CHUNK_MMAP
+  // 映射起点按页对齐, 一次顺序预读整个热区
+  if (_storage == storage::mapped)
+    ::madvise((void*)_buffer, _hot_size, MADV_WILLNEED);
+#endif
+}
+
 lua_util::chunk lua_util::chunk::build_chunk(
     std::unordered_map<uint64_t, std::span<uint8_t>> &chunks) {
   auto buffer = build_chunk_buffer(chunks);
@@ -278,29 +1110,612 @@ lua_util::chunk lua_util::chunk::build_chunk(
   return chunk(copy, buffer.size());
 }
 
+std::vector<uint8_t> lua_util::chunk::build_chunk_buffer(
+    std::unordered_map<uint64_t, std::span<uint8_t>> &chunks) {
+  return build_chunk_buffer(chunks, build_options());
+}
+
+std::vector<uint8_t> lua_util::chunk::build_chunk_buffer(
+    std::unordered_map<uint64_t, std::span<uint8_t>> &chunks, const build_options &options) {
+  if (!options.module_paths.empty()) {
+    // 模块索引在启动时最先读取, 放在热区最前面
+    auto index = module_index::build(options.module_paths);
+    auto with_index = chunks;
+    with_index[MODULE_INDEX_ID] = index;
+
+    auto index_options = options;
+    index_options.module_paths.clear();
+    index_options.hot_order.insert(index_options.hot_order.begin(), MODULE_INDEX_ID);
+    return build_chunk_buffer(with_index, index_options);
+  }
+
+  size_t hot_count = 0;
+  const auto ordered = ordered_chunks(chunks, options.hot_order, hot_count);
+
+  // 预先计算总大小, 一次性分配
+  const bool has_hot = hot_count > 0;
+  const size_t header_size = chunk_header_size(ordered.size(), has_hot, options.checksum);
+
+  auto entries = std::vector<entry>();
+  auto written = std::vector<bool>();
+  entries.reserve(ordered.size());
+  written.reserve(ordered.size());
+
+  auto layout = chunk_layout(header_size, options.deduplicate);
+  uint64_t hot_size = 0;
+  for (size_t i = 0; i < ordered.size(); i++) {
+    const auto &[id, chunk] = ordered[i];
+    const auto [offset, write] = layout.place(chunk);
+    entries.push_back({ id, offset, chunk.size(), options.checksum ? crc32c(chunk) : 0 });
+    written.push_back(write);
+    if (i + 1 == hot_count) hot_size = layout.end();
+  }
+
+  auto result = std::vector<uint8_t>(layout.end() + CHUNK_TRAILER_SIZE);
+  const auto sp = std::span<uint8_t>(result);
+
+  // write header, the hot prefix starts with it
+  write_chunk_header(sp.first(header_size), entries, hot_size, options.checksum);
+
+  // write chunks
+  for (size_t i = 0; i < ordered.size(); i++) {
+    const auto &chunk = ordered[i].second;
+    if (written[i] && !chunk.empty())
+      std::memcpy(result.data() + entries[i].offset, chunk.data(), chunk.size());
+  }
+
+  // write trailer
+  write_chunk_trailer(sp.last(CHUNK_TRAILER_SIZE), 0);
+  return result;
+}
+
+void lua_util::chunk::append_chunk_file(const std::string_view &filename,
+                                        std::unordered_map<uint64_t, std::span<uint8_t>> &chunks,
+                                        const std::vector<uint64_t> &removed) {
+  const auto path = std::string(filename);
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  if (!file.is_open()) {
+    write_file(path, build_chunk_buffer(chunks));
+    return;
+  }
+
+  // 只读取现有 header, 不读取数据
+  file.seekg(0, std::ios::end);
+  const uint64_t file_size = file.tellg();
+  const auto old_header = read_header([&](uint64_t offset, std::span<uint8_t> out) {
+    file.seekg(offset, std::ios::beg);
+    if (!file.read((char*)out.data(), out.size()))
+      throw std::runtime_error("failed to read file");
+  }, file_size);
+
+  // 合并 header: 保留未被替换或删除的旧条目, 新条目追加在文件末尾
+  auto dropped = std::unordered_set<uint64_t>(removed.begin(), removed.end());
+  for (const auto &[id, chunk] : chunks) dropped.insert(id);
+
+  const auto sorted = sorted_chunks(chunks);
+  auto entries = std::vector<entry>();
+  entries.reserve(old_header.entries.size() + sorted.size());
+  for (const auto &e : old_header.entries)
+    if (!dropped.contains(e.id)) entries.push_back(e);
+
+  // 只在本次追加的 chunk 之间去重, 旧数据不再读取
+  auto layout = chunk_layout(file_size, true);
+  auto written = std::vector<bool>();
+  written.reserve(sorted.size());
+  const bool checksum = old_header.checksum;
+  for (const auto &[id, chunk] : sorted) {
+    const auto [offset, write] = layout.place(chunk);
+    entries.push_back({ id, offset, chunk.size(), checksum ? crc32c(chunk) : 0 });
+    written.push_back(write);
+  }
+  const uint64_t data_size = layout.end() - file_size;
+
+  // [new chunks] [header] [trailer], 热区和校验方式保持不变
+  const auto hot_size = old_header.hot_size;
+  const size_t header_size = chunk_header_size(entries.size(), hot_size != 0, checksum);
+  auto tail = std::vector<uint8_t>(data_size + header_size + CHUNK_TRAILER_SIZE);
+  const auto sp = std::span<uint8_t>(tail);
+
+  const auto first_new = entries.size() - sorted.size();
+  for (size_t i = 0; i < sorted.size(); i++) {
+    const auto &chunk = sorted[i].second;
+    if (written[i] && !chunk.empty())
+      std::memcpy(tail.data() + entries[first_new + i].offset - file_size, chunk.data(), chunk.size());
+  }
+  write_chunk_header(sp.subspan(data_size, header_size), entries, hot_size, checksum);
+  write_chunk_trailer(sp.last(CHUNK_TRAILER_SIZE), file_size + data_size);
+
+  file.clear();
+  file.seekp(0, std::ios::end);
+  if (!file.write((const char*)tail.data(), tail.size()) || !file.flush())
+    throw std::runtime_error("failed to write file");
+}
+
+void lua_util::chunk::compact_chunk_file(const std::string_view &filename) {
+  const auto path = std::string(filename);
+  auto buffer = std::vector<uint8_t>();
+  {
+    const auto source = chunk(filename);
+    auto live = chunk_map();
+    live.reserve(source.size());
+
+    // 保留热区内 chunk 的原有顺序, 校验失败时不改写原文件
+    auto hot = std::vector<std::pair<size_t, uint64_t>>();
+    for (const auto &[id, s] : source._data_map) {
+      if (source._checksum && crc32c(s.data) != s.crc)
+        throw std::runtime_error("invalid chunk: checksum mismatch");
+      // 源文件是本函数打开的私有映射或自有缓冲区, 构建时只读取
+      live[id] = { const_cast<uint8_t*>(s.data.data()), s.data.size() };
+      const size_t offset = s.data.data() - source._buffer;
+      if (offset < source._hot_size) hot.emplace_back(offset, id);
+    }
+    std::sort(hot.begin(), hot.end());
+
+    auto options = build_options();
+    options.checksum = source._checksum;
+    for (const auto &[offset, id] : hot) options.hot_order.push_back(id);
+    buffer = build_chunk_buffer(live, options);
+  }
+
+  // 先写临时文件再替换, 中途失败不会破坏原文件
+  const auto tmp = path + ".compact";
+  write_file(tmp, buffer);
+  std::filesystem::rename(tmp, path);
+}
+
+lua_util::lua_custom_requirer::resolved
+lua_util::lua_custom_requirer::resolve(std::string_view module_name) {
+  const auto it = _resolved.find(module_name);
+  if (it != _resolved.end()) return it->second;
+
+  auto result = resolved{ id_tree::NULL_DATA, {}, nullptr };
+  try {
+    if (!_module_index_loaded) {
+      _module_index_loaded = true;
+      const auto raw = _lua_src_chunk.get(chunk::MODULE_INDEX_ID);
+      if (!raw.empty()) _module_index = module_index(raw);
+    }
+
+    // 优先使用 archive 内的模块索引, 索引中没有时再逐段解析路径
+    if (const auto chunk_id = _module_index.find(module_name); chunk_id != module_index::NULL_ID) {
+      if (auto chunk = _lua_src_chunk.get(chunk_id); !chunk.empty()) {
+        result = { chunk_id, chunk, nullptr };
+        _resolved.emplace(std::string(module_name), result);
+        return result;
+      }
+    }
+
+    const auto ids = _lua_src_path_collection.to_ids(module_name);
+    const auto* tree_node = _lua_src_tree.find_node(ids);
+    if (!tree_node || tree_node->data() == id_tree::NULL_DATA) {
+      result.error = "tree_node not found";
+    } else if (auto chunk = _lua_src_chunk.get(tree_node->data()); chunk.empty()) {
+      result.error = _lua_src_chunk.contains(tree_node->data()) ? "chunk empty or corrupted" : "chunk missing";
+    } else {
+      result = { tree_node->data(), chunk, nullptr };
+    }
+  } catch (const std::runtime_error&) {
+    result.error = "invalid path";
+  }
+
+  // 未命中的结果数量有上限, 超出后不再缓存
+  if (result.chunk_id == id_tree::NULL_DATA) {
+    if (_cached_misses >= MAX_CACHED_MISSES) return result;
+    _cached_misses++;
+  }
+  _resolved.emplace(std::string(module_name), result);
+  return result;
+}
+
+void lua_util::lua_custom_requirer::set_lua_src_chunk(chunk_stack &&chunks) {
+  _lua_src_chunk = std::move(chunks);
+  // 旧 chunk 已释放, 预加载的模块在下次 reload 时视为已修改
+  for (auto &[name, chunk] : _preloaded) chunk = {};
+  clear_cache();
+}
+
+void lua_util::lua_custom_requirer::set_lua_src_tree(id_tree &&tree) {
+  _lua_src_tree = std::move(tree);
+  clear_cache();
+}
+
+void lua_util::lua_custom_requirer::set_lua_src_path_collection(path_part_collection &&parts) {
+  _lua_src_path_collection = std::move(parts);
+  clear_cache();
+}
+
+void lua_util::lua_custom_requirer::clear_cache() {
+  _resolved.clear();
+  _cached_misses = 0;
+  _module_index = {};
+  _module_index_loaded = false;
+}
+
+std::vector<std::pair<std::string, uint64_t>> lua_util::lua_custom_requirer::enumerate(std::string_view prefix) {
+  auto result = std::vector<std::pair<std::string, uint64_t>>();
+
+  // 1. 在路径树中找到前缀对应的子树
+  const id_tree* root = nullptr;
+  auto prefix_ids = std::vector<size_t>();
+  try {
+    prefix_ids = _lua_src_path_collection.to_ids(prefix);
+    root = prefix_ids.empty() ? &_lua_src_tree : _lua_src_tree.find_node(prefix_ids);
+  } catch (const std::runtime_error&) {}
+
+  if (root && (root != &_lua_src_tree || _lua_src_tree.valid_idx(0))) {
+    auto ids = prefix_ids;
+    const auto add = [&](const id_tree &node) {
+      if (node.data() == id_tree::NULL_DATA) return;
+      result.emplace_back(_lua_src_path_collection.to_path(ids), node.data());
+    };
+    if (root != &_lua_src_tree) add(*root);
+    root->for_each_descendant([&](std::span<const size_t> sub_ids, const id_tree &node) {
+      ids.resize(prefix_ids.size());
+      ids.insert(ids.end(), sub_ids.begin(), sub_ids.end());
+      add(node);
+    });
+  } else {
+    // 2. 没有路径树时使用模块索引, 同一 chunk 的多个名字只保留一个
+    if (!_module_index_loaded) resolve(prefix);
+    auto normalized = std::string();
+    path_part_collection::enumerate_path(prefix, [&](const std::string_view &part) {
+      if (part == path_part_collection::CURR_DIR) return;
+      if (!normalized.empty()) normalized.push_back('/');
+      normalized.append(part);
+    });
+    auto seen = std::unordered_set<uint64_t>();
+    _module_index.for_each([&](std::string_view path, uint64_t chunk_id) {
+      const bool under = normalized.empty() || path == normalized ||
+        (path.starts_with(normalized) && path[normalized.size()] == '/');
+      if (under && seen.insert(chunk_id).second) result.emplace_back(std::string(path), chunk_id);
+    });
+  }
+
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+size_t lua_util::lua_custom_requirer::preload(lua_State *L, std::string_view prefix) {
+  // 按 chunk 在 archive 中的位置排序, 顺序读取
+  auto modules = std::vector<std::pair<std::string, std::span<const uint8_t>>>();
+  for (auto &[name, chunk_id] : enumerate(prefix)) {
+    const auto chunk = _lua_src_chunk.get(chunk_id);
+    if (!chunk.empty()) modules.emplace_back(std::move(name), chunk);
+  }
+  std::sort(modules.begin(), modules.end(),
+    [](const auto &a, const auto &b) { return std::less<const uint8_t*>()(a.second.data(), b.second.data()); });
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaded");
+  lua_getfield(L, -2, "preload");
+  const int loaded = lua_gettop(L) - 1;
+  const int preloaded = lua_gettop(L);
+
+  size_t count = 0;
+  for (const auto &[name, chunk] : modules) {
+    lua_getfield(L, loaded, name.c_str());
+    lua_getfield(L, preloaded, name.c_str());
+    const bool skip = !lua_isnil(L, -1) || !lua_isnil(L, -2);
+    lua_pop(L, 2);
+    if (skip) continue;
+
+    if (luaL_loadbuffer(L, (const char*)chunk.data(), chunk.size(), name.c_str())) {
+      auto error = std::string("failed to preload ") + name + ": " + lua_tostring(L, -1);
+      lua_pop(L, 4);
+      throw std::runtime_error(error);
+    }
+    lua_setfield(L, preloaded, name.c_str());
+    _preloaded.insert_or_assign(name, chunk);
+    count++;
+  }
+  lua_pop(L, 3);
+  return count;
+}
+
+lua_util::lua_custom_requirer::reload_result
+lua_util::lua_custom_requirer::reload(lua_State *L, chunk_stack &&chunks, bool re_require) {
+  // 1. 记下已解析的模块, 旧的 chunk 在比较完成前保持有效
+  auto previous = std::vector<std::pair<std::string, std::span<const uint8_t>>>();
+  for (const auto &[name, module] : _resolved)
+    if (module.chunk_id != id_tree::NULL_DATA) previous.emplace_back(name, module.chunk);
+  for (const auto &[name, chunk] : _preloaded)
+    if (!_resolved.contains(name)) previous.emplace_back(name, chunk);
+  std::sort(previous.begin(), previous.end(),
+    [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  auto old_chunks = std::move(_lua_src_chunk);
+  _lua_src_chunk = std::move(chunks);
+  clear_cache();
+
+  // 2. 按名字重新解析, 内容不同或已删除的模块需要失效
+  auto result = reload_result();
+  for (const auto &[name, old_chunk] : previous) {
+    const auto module = resolve(name);
+    const auto &chunk = module.chunk;
+    const bool same = module.chunk_id != id_tree::NULL_DATA && chunk.size() == old_chunk.size() &&
+      (chunk.data() == old_chunk.data() || std::memcmp(chunk.data(), old_chunk.data(), chunk.size()) == 0);
+    if (!same) result.changed.push_back(name);
+
+    // 预加载的模块记录新的 chunk, 旧 chunk 即将释放
+    if (const auto it = _preloaded.find(name); it != _preloaded.end()) it->second = chunk;
+  }
+
+  // 3. 重建或移除预加载的函数, 之后的 require 使用新的 chunk
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaded");
+  lua_getfield(L, -2, "preload");
+  const int loaded = lua_gettop(L) - 1;
+  const int preloaded = lua_gettop(L);
+  for (const auto &name : result.changed) {
+    const auto it = _preloaded.find(name);
+    if (it == _preloaded.end()) continue;
+    if (it->second.empty() ||
+        luaL_loadbuffer(L, (const char*)it->second.data(), it->second.size(), name.c_str()) != LUA_OK) {
+      if (!it->second.empty()) {
+        result.failed.emplace_back(name, lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+      lua_pushnil(L);
+      _preloaded.erase(it);
+    }
+    lua_setfield(L, preloaded, name.c_str());
+  }
+
+  // 4. 从 package.loaded 中移除, 按需重新 require
+  for (const auto &name : result.changed) {
+    lua_getfield(L, loaded, name.c_str());
+    const bool was_loaded = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!was_loaded) continue;
+
+    lua_pushnil(L);
+    lua_setfield(L, loaded, name.c_str());
+    if (!re_require) continue;
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, name.c_str());
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+      const char* error = lua_tostring(L, -1);
+      result.failed.emplace_back(name, error ? error : "unknown error");
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 3);
+  return result;
+}
+
+lua_util::lua_custom_requirer::reload_result
+lua_util::lua_custom_requirer::reload(lua_State *L, const std::string_view &filename, bool re_require) {
+  auto base = chunk(filename);
+
+  // 补丁层移到新的 stack, buffer 地址不变; 旧的 base 在比较完成前保持有效
+  auto layers = _lua_src_chunk.release();
+  auto old_base = layers.empty() ? chunk() : std::move(layers.front());
+  if (layers.empty()) layers.push_back(std::move(base));
+  else layers.front() = std::move(base);
+  return reload(L, chunk_stack(std::move(layers)), re_require);
+}
+
 int lua_util::lua_custom_requirer::require(lua_State *L) {
-  const char* module_name = luaL_checkstring(L, 1);
-  auto ids = lua_src_path_collection.to_ids(module_name);
+  size_t name_size = 0;
+  const char* module_name = luaL_checklstring(L, 1, &name_size);
+  const auto name = std::string_view(module_name, name_size);
 
-  auto node_idx = lua_src_tree.find(ids);
-  if (node_idx == lua_util::id_tree::NULL_IDX) {
-    return luaL_error(L, "module not found: %s, tree_node not found", module_name);
+  // 先查解析缓存, 命中时不访问 package 表
+  const auto cached = _resolved.find(name);
+  if (cached == _resolved.end()) {
+    // 已预加载的模块交给 package.preload 的 searcher
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_getfield(L, -1, module_name);
+    const bool preloaded = !lua_isnil(L, -1);
+    lua_pop(L, 3);
+    if (preloaded) {
+      lua_pushfstring(L, "\n\tmodule '%s' is in package.preload", module_name);
+      return 1;
+    }
   }
 
-  auto& tree_node = lua_src_tree.get_child(node_idx);
-  auto chunk = lua_src_chunk.get(tree_node.id());
-  if (chunk.empty()) {
-    return luaL_error(L, "module not found: %s, chunk empty", module_name);
+  // 未找到时返回说明, 由 require 继续尝试后面的 searcher
+  const auto module = cached != _resolved.end() ? cached->second : resolve(name);
+  if (module.chunk_id == id_tree::NULL_DATA) {
+    _stats.misses++;
+    lua_pushfstring(L, "\n\tno module '%s' in chunk archive (%s)", module_name, module.error);
+    return 1;
   }
 
+  using namespace std::chrono;
+  const auto chunk = module.chunk;
+  const auto begin = steady_clock::now();
   const auto ret = luaL_loadbuffer(L, (const char*)chunk.data(), chunk.size(), module_name);
+  const auto load_ns = (uint64_t)duration_cast<nanoseconds>(steady_clock::now() - begin).count();
+
+  _stats.hits++;
+  _stats.bytes += chunk.size();
+  _stats.load_ns += load_ns;
+
+  auto it = _module_stats.find(name);
+  if (it == _module_stats.end()) it = _module_stats.emplace(std::string(name), module_stats()).first;
+  it->second.loads++;
+  it->second.bytes += chunk.size();
+  it->second.load_ns += load_ns;
+
+  if (_recording) {
+    _records.push_back({
+      module.chunk_id,
+      std::string(name),
+      (uint64_t)duration_cast<nanoseconds>(begin - _record_begin).count(),
+      load_ns,
+    });
+  }
+
   if (ret) {
-    return luaL_error(L, "module not found: %s, load buffer error: %s", module_name, lua_tostring(L, -1));
+    return luaL_error(L, "error loading module '%s' from chunk archive:\n\t%s", module_name, lua_tostring(L, -1));
   }
   return 1;
 }
 
-void lua_util::lua_custom_requirer::register_requirer(lua_State *L, int(*requirer)(lua_State*)) {
+int lua_util::lua_custom_requirer::searcher(lua_State *L) {
+  auto* requirer = (lua_custom_requirer*)lua_touserdata(L, lua_upvalueindex(1));
+  return requirer->require(L);
+}
+
+int lua_util::lua_custom_requirer::lazy_require_closure(lua_State *L) {
+  auto* requirer = (lua_custom_requirer*)lua_touserdata(L, lua_upvalueindex(1));
+  return requirer->lazy_require(L);
+}
+
+/// push the module behind a lazy proxy, requiring it on first use
+/// @param proxy: the index of the proxy
+static void lazy_module(lua_State *L, int proxy) {
+  proxy = lua_absindex(L, proxy);
+  lua_getmetatable(L, proxy);
+  const int mt = lua_gettop(L);
+
+  // 已加载过则直接返回
+  lua_getfield(L, mt, "__module");
+  if (!lua_isnil(L, -1)) {
+    lua_remove(L, mt);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "require");
+  lua_getfield(L, mt, "__module_name");
+  lua_call(L, 1, 1);
+
+  // 模块是表时直接挂到元表上, 之后的访问不再经过 C 函数
+  lua_pushvalue(L, -1);
+  lua_setfield(L, mt, "__module");
+  if (lua_istable(L, -1)) {
+    lua_pushvalue(L, -1);
+    lua_setfield(L, mt, "__index");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, mt, "__newindex");
+  }
+  lua_remove(L, mt);
+}
+
+static int lazy_index(lua_State *L) {
+  lazy_module(L, 1);
+  lua_pushvalue(L, 2);
+  lua_gettable(L, -2);
+  return 1;
+}
+
+static int lazy_newindex(lua_State *L) {
+  lazy_module(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_settable(L, -3);
+  return 0;
+}
+
+static int lazy_call(lua_State *L) {
+  lazy_module(L, 1);
+  lua_replace(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+static int lazy_len(lua_State *L) {
+  lazy_module(L, 1);
+  lua_len(L, -1);
+  return 1;
+}
+
+static int lazy_pairs(lua_State *L) {
+  lazy_module(L, 1);
+  lua_getglobal(L, "pairs");
+  lua_insert(L, -2);
+  lua_call(L, 1, 3);
+  return 3;
+}
+
+int lua_util::lua_custom_requirer::lazy_require(lua_State *L) {
+  size_t name_size = 0;
+  const char* module_name = luaL_checklstring(L, 1, &name_size);
+  lua_settop(L, 1);
+
+  // 已加载或不在 archive 中的模块直接 require
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaded");
+  lua_getfield(L, -1, module_name);
+  const bool loaded = !lua_isnil(L, -1);
+  lua_pop(L, 3);
+  if (loaded || resolve({ module_name, name_size }).chunk_id == id_tree::NULL_DATA) {
+    lua_getglobal(L, "require");
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    return 1;
+  }
+
+  lua_newtable(L); // proxy
+  lua_createtable(L, 0, 7); // metatable
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "__module_name");
+
+  const luaL_Reg metamethods[] = {
+    { "__index", lazy_index },
+    { "__newindex", lazy_newindex },
+    { "__call", lazy_call },
+    { "__len", lazy_len },
+    { "__pairs", lazy_pairs },
+  };
+  for (const auto &[name, func] : metamethods) {
+    lua_pushcfunction(L, func);
+    lua_setfield(L, -2, name);
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+void lua_util::lua_custom_requirer::register_lazy_require(lua_State *L, const char* name) {
+  lua_pushlightuserdata(L, this);
+  lua_pushcclosure(L, &lua_custom_requirer::lazy_require_closure, 1);
+  lua_setglobal(L, name);
+}
+
+void lua_util::lua_custom_requirer::for_each_module_stats(
+    const std::function<void(std::string_view module_name, const module_stats &stats)> &func) const {
+  for (const auto &[name, stats] : _module_stats) func(name, stats);
+}
+
+void lua_util::lua_custom_requirer::reset_stats() {
+  _stats = {};
+  _module_stats.clear();
+}
+
+void lua_util::lua_custom_requirer::start_recording() {
+  _records.clear();
+  _recording = true;
+  _record_begin = std::chrono::steady_clock::now();
+}
+
+std::vector<lua_util::lua_custom_requirer::load_record> lua_util::lua_custom_requirer::stop_recording() {
+  _recording = false;
+  return std::move(_records);
+}
+
+std::vector<uint64_t> lua_util::lua_custom_requirer::load_order(const std::vector<load_record> &records) {
+  auto result = std::vector<uint64_t>();
+  auto seen = std::unordered_set<uint64_t>();
+  result.reserve(records.size());
+  for (const auto &record : records)
+    if (seen.insert(record.chunk_id).second) result.push_back(record.chunk_id);
+  return result;
+}
+
+std::vector<std::string> lua_util::lua_custom_requirer::load_order_names(const std::vector<load_record> &records) {
+  auto result = std::vector<std::string>();
+  auto seen = std::unordered_set<uint64_t>();
+  result.reserve(records.size());
+  for (const auto &record : records)
+    if (seen.insert(record.chunk_id).second) result.push_back(record.module_name);
+  return result;
+}
+
+static void insert_searcher(lua_State *L) {
   // 1. 获取 package.searchers 表 (Lua 5.1 使用 package.loaders)
   lua_getglobal(L, "package");
 
@@ -320,12 +1735,143 @@ void lua_util::lua_custom_requirer::register_requirer(lua_State *L, int(*require
       lua_rawseti(L, searchers_idx, i + 1);
   }
 
-  // 插入自定义加载器为第一个
-  lua_pushcfunction(L, requirer);
+  // 插入栈顶下方的自定义加载器为第一个
+  lua_pushvalue(L, searchers_idx - 2);
   lua_rawseti(L, searchers_idx, 1);
 
   // 3. 清理栈
-  lua_pop(L, 2); // 弹出 package.searchers 和 package
+  lua_pop(L, 3); // 弹出 package.searchers, package 和加载器
+}
+
+void lua_util::lua_custom_requirer::register_requirer(lua_State *L, int(*requirer)(lua_State*)) {
+  lua_pushcfunction(L, requirer);
+  insert_searcher(L);
+}
+
+void lua_util::lua_custom_requirer::register_requirer(lua_State *L) {
+  lua_pushlightuserdata(L, this);
+  lua_pushcclosure(L, &lua_custom_requirer::searcher, 1);
+  insert_searcher(L);
+}
+
+lua_util::module_archive::module_archive(chunk_stack &&chunks, const id_tree &tree, path_part_collection &&parts)
+    : _chunks(std::move(chunks)), _tree(tree), _parts(std::move(parts)) {
+  if (const auto raw = _chunks.get(chunk::MODULE_INDEX_ID); !raw.empty()) _index = module_index(raw);
+}
+
+lua_util::module_archive::module_archive(chunk_stack &&chunks) : _chunks(std::move(chunks)) {
+  const auto tree = _chunks.get(chunk::TREE_ID);
+  const auto parts = _chunks.get(chunk::PATH_PARTS_ID);
+  if (tree.empty() || parts.empty()) throw std::runtime_error("module archive metadata missing or corrupted");
+
+  _tree_view = id_tree_view(tree);
+  _parts = path_part_collection::deserialize(parts);
+  if (const auto raw = _chunks.get(chunk::MODULE_INDEX_ID); !raw.empty()) _index = module_index(raw);
+}
+
+uint64_t lua_util::module_archive::find(std::string_view module_name) const {
+  if (const auto chunk_id = _index.find(module_name); chunk_id != module_index::NULL_ID) return chunk_id;
+
+  try {
+    const auto ids = _parts.to_ids(module_name);
+    if (_tree_view.size()) {
+      const auto node = _tree_view.find(ids);
+      return node == id_tree_view::NULL_IDX ? id_tree::NULL_DATA : _tree_view.data(node);
+    }
+    const auto node = _tree.find(ids);
+    return node == frozen_id_tree::NULL_IDX ? id_tree::NULL_DATA : _tree.data(node);
+  } catch (const std::runtime_error&) {
+    return id_tree::NULL_DATA;
+  }
+}
+
+int lua_util::module_archive::searcher(lua_State *L) {
+  const auto &archive = *(std::shared_ptr<const module_archive>*)lua_touserdata(L, lua_upvalueindex(1));
+
+  size_t name_size = 0;
+  const char* module_name = luaL_checklstring(L, 1, &name_size);
+  const auto chunk_id = archive->find({ module_name, name_size });
+  const auto chunk = chunk_id == id_tree::NULL_DATA ? std::span<const uint8_t>() : archive->_chunks.get(chunk_id);
+  if (chunk.empty()) {
+    lua_pushfstring(L, "\n\tno module '%s' in module archive", module_name);
+    return 1;
+  }
+
+  if (luaL_loadbuffer(L, (const char*)chunk.data(), chunk.size(), module_name)) {
+    return luaL_error(L, "error loading module '%s' from module archive:\n\t%s", module_name, lua_tostring(L, -1));
+  }
+  return 1;
+}
+
+int lua_util::module_archive::gc(lua_State *L) {
+  auto* archive = (std::shared_ptr<const module_archive>*)lua_touserdata(L, 1);
+  archive->~shared_ptr();
+  return 0;
+}
+
+void lua_util::module_archive::register_searcher(lua_State *L, std::shared_ptr<const module_archive> archive) {
+  if (!archive) throw std::runtime_error("null module archive");
+
+  // 引用保存在 userdata 中, 状态机关闭时由 __gc 释放
+  auto* ud = lua_newuserdata(L, sizeof(std::shared_ptr<const module_archive>));
+  new (ud) std::shared_ptr<const module_archive>(std::move(archive));
+  if (luaL_newmetatable(L, "lua_util.module_archive")) {
+    lua_pushcfunction(L, &module_archive::gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+
+  lua_pushcclosure(L, &module_archive::searcher, 1);
+  insert_searcher(L);
+}
+
+lua_util::path_part_collection
+lua_util::path_part_collection::deserialize(std::span<const uint8_t> buffer) {
+  constexpr size_t PART_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+  if (buffer.size() < sizeof(uint32_t)) throw std::runtime_error("invalid path parts: truncated");
+
+  auto result = path_part_collection();
+  const auto count = read_bytes<uint32_t>(buffer);
+  size_t offset = sizeof(uint32_t);
+  for (uint32_t i = 0; i < count; i++) {
+    if (buffer.size() - offset < PART_HEADER_SIZE) throw std::runtime_error("invalid path parts: truncated");
+    const auto id = read_bytes<uint64_t>(buffer, offset);
+    const auto size = read_bytes<uint32_t>(buffer, offset + sizeof(uint64_t));
+    offset += PART_HEADER_SIZE;
+    if (buffer.size() - offset < size) throw std::runtime_error("invalid path parts: truncated");
+    result.add_part({ (const char*)buffer.data() + offset, size }, id);
+    offset += size;
+  }
+  return result;
+}
+
+std::string lua_util::path_part_collection::to_path(std::span<const size_t> ids) const {
+  auto result = std::string();
+  for (const auto id : ids) {
+    const auto it = _parts.find(id);
+    if (it == _parts.end()) throw std::runtime_error("invalid path: path part id not found");
+    if (!result.empty()) result.push_back('/');
+    result.append(it->second);
+  }
+  return result;
+}
+
+void lua_util::path_part_collection::serialize(std::vector<uint8_t> &output) const {
+  if (_map.size() > UINT32_MAX) throw std::length_error("too many path parts");
+
+  // 按 id 排序, 同样的集合总是得到同样的字节
+  auto parts = std::vector<std::pair<size_t, std::string_view>>();
+  parts.reserve(_map.size());
+  for (const auto &[part, id] : _map) parts.emplace_back(id, part);
+  std::sort(parts.begin(), parts.end());
+
+  write_bytes(output, (uint32_t)parts.size());
+  for (const auto &[id, part] : parts) {
+    if (part.size() > UINT32_MAX) throw std::length_error("path part too long");
+    write_bytes(output, (uint64_t)id);
+    write_bytes(output, (uint32_t)part.size());
+    output.insert(output.end(), part.begin(), part.end());
+  }
 }
 
 void lua_util::path_part_collection::enumerate_path(
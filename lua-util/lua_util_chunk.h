@@ -1,8 +1,16 @@
+#pragma once
+
 #include <bit>
 #include <span>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <string>
 #include <vector>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
+#include <algorithm>
 #include <functional>
 #include <unordered_map>
 
@@ -10,6 +18,66 @@ struct lua_State;
 
 namespace lua_util {
 
+/// byte order of every multi-byte value written and read by the helpers below
+/// archives are always stored little-endian so they can be shared across platforms
+constexpr std::endian BYTES_ORDER = std::endian::little;
+
+namespace detail {
+
+/// reverse the byte order of a value (std::byteswap is c++23)
+/// @tparam T: the type of the value, must be unsigned
+template<typename T>
+constexpr T byteswap(T value) noexcept {
+  static_assert(std::is_unsigned_v<T>, "must be unsigned");
+  if constexpr (sizeof(T) == 1) return value;
+#if defined(__GNUC__) || defined(__clang__)
+  else if constexpr (sizeof(T) == 2) return __builtin_bswap16(value);
+  else if constexpr (sizeof(T) == 4) return __builtin_bswap32(value);
+  else if constexpr (sizeof(T) == 8) return __builtin_bswap64(value);
+#endif
+  else {
+    T result = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      result = (T)((result << 8) | (value & 0xff));
+      value >>= 8;
+    }
+    return result;
+  }
+}
+
+/// bulk store values as BYTES_ORDER bytes
+/// a plain memcpy on little-endian targets, otherwise a byteswap loop that
+/// compilers lower to vector shuffles
+template<typename T>
+inline void store_bytes(uint8_t* dst, const T* src, size_t count) noexcept {
+  static_assert(std::is_unsigned_v<T>, "must be unsigned");
+  if constexpr (std::endian::native == BYTES_ORDER || sizeof(T) == 1) {
+    if (count) std::memcpy(dst, src, count * sizeof(T));
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      const T v = byteswap(src[i]);
+      std::memcpy(dst + i * sizeof(T), &v, sizeof(T));
+    }
+  }
+}
+
+/// bulk load values from BYTES_ORDER bytes
+template<typename T>
+inline void load_bytes(T* dst, const uint8_t* src, size_t count) noexcept {
+  static_assert(std::is_unsigned_v<T>, "must be unsigned");
+  if constexpr (std::endian::native == BYTES_ORDER || sizeof(T) == 1) {
+    if (count) std::memcpy(dst, src, count * sizeof(T));
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      T v;
+      std::memcpy(&v, src + i * sizeof(T), sizeof(T));
+      dst[i] = byteswap(v);
+    }
+  }
+}
+
+} // namespace detail
+
 /// write bytes to vector
 /// @tparam T: the type of the value to write, must be unsigned
 /// @param target: the vector to write to
@@ -17,51 +85,69 @@ namespace lua_util {
 template<typename T>
 void write_bytes(std::vector<uint8_t>& target, T value) {
   static_assert(std::is_unsigned_v<T>, "must be unsigned");
+  const auto offset = target.size();
+  target.resize(offset + sizeof(T));
+  detail::store_bytes(target.data() + offset, &value, 1);
+}
 
-  if constexpr (std::endian::native == std::endian::big) {
-    for (int i = sizeof(T)-1; i >= 0; i--)
-      target.push_back((value >> (i * 8)) & 0xff);
-  } else {
-    // 小端序反转字节序
-    for (int i = 0; i < sizeof(T); i++)
-      target.push_back((value >> (i * 8)) & 0xff);
-  }
+/// write bytes to a preallocated buffer
+/// @tparam T: the type of the value to write, must be unsigned
+/// @param target: the buffer to write to, must hold offset + sizeof(T) bytes
+/// @param value: the value to write
+/// @param offset: the offset to write at
+template<typename T>
+void write_bytes(std::span<uint8_t> target, T value, size_t offset) {
+  static_assert(std::is_unsigned_v<T>, "must be unsigned");
+  detail::store_bytes(target.data() + offset, &value, 1);
 }
 
 /// read bytes from vector
 /// @tparam T: the type of the value to read, must be unsigned
-/// @param data: the vector to read from
+/// @param data: the vector to read from, must hold offset + sizeof(T) bytes
 /// @param offset: the offset to read from
 /// @return the value read
 template<typename T>
-T read_bytes(const std::span<uint8_t>& data, int offset = 0) {
+T read_bytes(std::span<const uint8_t> data, size_t offset = 0) {
   static_assert(std::is_unsigned_v<T>, "must be unsigned");
-
-  T value = 0;
-  if constexpr (std::endian::native == std::endian::big) {
-    const int end = offset + sizeof(T);
-    for (int i = end-1; i >= offset; --i)
-      value |= (T)data[i] << (i * 8);
-  } else {
-    // 小端序反转字节序
-    const int end = offset + sizeof(T);
-    for (int i = offset; i < end; ++i)
-      value |= (T)data[i] << (i * 8);
-  }
+  T value;
+  detail::load_bytes(&value, data.data() + offset, 1);
   return value;
 }
 
+/// convert values to bytes
+/// @tparam T: the type of the values to convert, must be unsigned
+/// @param values: the values to convert
+/// @param target: the output buffer, must hold values.size_bytes() bytes
+template<typename T>
+void to_bytes(std::span<const T> values, std::span<uint8_t> target) {
+  if (target.size() < values.size_bytes())
+    throw std::out_of_range("target buffer too small");
+  detail::store_bytes(target.data(), values.data(), values.size());
+}
+
 /// convert a value to bytes
 /// @tparam T: the type of the value to convert
 /// @param value: the value to convert
 /// @return the bytes of the value
 template<typename T>
 std::vector<uint8_t> to_bytes(T* value, size_t count) {
-  std::vector<uint8_t> result;
-  for (size_t i = 0; i < count; i++) write_bytes(result, value[i]);
+  std::vector<uint8_t> result(count * sizeof(T));
+  detail::store_bytes(result.data(), value, count);
   return result;
 }
 
+/// convert bytes to values
+/// @tparam T: the type of the values to convert, must be unsigned
+/// @param data: the bytes to convert, a trailing partial value is ignored
+/// @param target: the output values, must hold data.size() / sizeof(T) values
+template<typename T>
+void from_bytes(std::span<const uint8_t> data, std::span<T> target) {
+  const auto count = data.size() / sizeof(T);
+  if (target.size() < count)
+    throw std::out_of_range("target buffer too small");
+  detail::load_bytes(target.data(), data.data(), count);
+}
+
 /// convert bytes to a value
 /// @tparam T: the type of the value to convert
 /// @param data: the bytes to convert
@@ -69,15 +155,25 @@ std::vector<uint8_t> to_bytes(T* value, size_t count) {
 /// @return the value
 template<typename T>
 std::vector<T> from_bytes(uint8_t* data, size_t count) {
-  std::vector<T> result;
-  count = count - count % sizeof(T);
-
-  const auto sp = std::span<uint8_t>(data, count);
-  for (size_t i = 0; i < count; i += sizeof(T))
-    result.push_back(read_bytes<T>(sp, i));
+  std::vector<T> result(count / sizeof(T));
+  detail::load_bytes(result.data(), data, result.size());
   return result;
 }
 
+/// hash bytes
+/// the hash is stable across platforms and runs, so it may be stored in archives
+/// @param data: the bytes to hash
+/// @param seed: the seed of the hash
+/// @return the hash of the bytes
+uint64_t hash_bytes(std::span<const uint8_t> data, uint64_t seed = 0);
+
+/// crc32c (castagnoli) of bytes
+/// uses the sse4.2 or armv8 crc instructions when available
+/// @param data: the bytes to check
+/// @param crc: the crc of the preceding bytes, to checksum in several steps
+/// @return the crc of the bytes
+uint32_t crc32c(std::span<const uint8_t> data, uint32_t crc = 0);
+
 /// id tree
 /// id_tree is a tree that each node has a id and a data
 class id_tree {
@@ -94,6 +190,7 @@ public:
   static std::unique_ptr<id_tree> deserialize(size_t* nodes, size_t node_count);
 
   /// id tree serializer
+  /// the output is platform-width, see id_tree_view::serialize for the portable form
   /// @param tree: the tree to serialize
   /// @param output: the output vector
   static void serialize(const id_tree& tree, std::vector<size_t>& output);
@@ -129,6 +226,22 @@ public:
     return idx;
   }
 
+  /// find the node with the given ids
+  /// @param ids: the ids from the child of this node down to the node
+  /// @return the node, or nullptr if not found
+  template<typename T>
+  const id_tree* find_node(const T &ids) const
+  requires std::is_same_v<typename T::value_type, size_t> {
+    if (ids.empty()) return nullptr;
+    const id_tree* node = this;
+    for (auto i = ids.begin(); i < ids.end(); i++) {
+      const auto idx = node->find(*i);
+      if (idx == NULL_IDX) return nullptr;
+      node = node->_children[idx];
+    }
+    return node;
+  }
+
   /// check if the index is valid
   /// @param idx: the index of the child
   inline const bool valid_idx(int32_t idx) const { return idx >= 0 && idx < _children.size(); }
@@ -148,17 +261,27 @@ public:
   int32_t push(id_tree&& other);
   int32_t push(size_t id, size_t data = id_tree::NULL_DATA);
 
-  /// for each child
-  /// @param func: the function to call for each child
+  /// for each node of the subtree, this node first, depth first
+  /// @param func: the function to call for each node
   void for_each_child(
       const std::function<void(const id_tree &children)> &func) const;
 
+  /// for each node below this one, depth first, parents before children
+  /// iterative, so deep trees do not overflow the stack
+  /// @param func: the function to call with the ids from the child of this node down to the node, and the node
+  void for_each_descendant(
+      const std::function<void(std::span<const size_t> ids, const id_tree &node)> &func) const;
+
 public:
   ~id_tree();
   id_tree(): _id(0), _data(NULL_DATA) {}
   id_tree(size_t id, size_t data = id_tree::NULL_DATA);
 
 private:
+  friend class frozen_id_tree;
+  friend class id_tree_view;
+  friend class lua_custom_requirer;
+
   id_tree(id_tree&& other);
   id_tree& operator=(id_tree&& other);
 
@@ -172,16 +295,264 @@ private:
   std::vector<id_tree*> _children;
 };
 
+namespace detail {
+
+/// transparent string hash, lets string keyed maps be probed with a string_view
+struct string_hash {
+  using is_transparent = void;
+  inline size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+/// first position in sorted ids whose id is not less than the given id
+/// branch free: a counting scan for small fan-outs, a conditional-move binary search otherwise
+/// @param load: loads the id at a position
+template<typename Load>
+inline uint32_t lower_bound_ids(const Load &load, uint32_t count, uint64_t id) {
+  if (count <= 16) {
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) pos += load(i) < id;
+    return pos;
+  }
+
+  uint32_t base = 0, len = count;
+  while (len > 1) {
+    const uint32_t half = len / 2;
+    base = load(base + half - 1) < id ? base + half : base;
+    len -= half;
+  }
+  return base + (load(base) < id);
+}
+
+} // namespace detail
+
+/// frozen id tree
+/// an immutable id_tree packed into a single allocation. nodes are stored breadth
+/// first, so the children of a node are contiguous and sorted by id, and lookups
+/// scan flat arrays instead of chasing a pointer per node.
+class frozen_id_tree {
+public:
+  static constexpr size_t NULL_DATA = id_tree::NULL_DATA;
+  static constexpr int32_t NULL_IDX = id_tree::NULL_IDX;
+  /// the index of the root node
+  static constexpr int32_t ROOT = 0;
+
+public:
+  frozen_id_tree() = default;
+  explicit frozen_id_tree(const id_tree &tree);
+
+  frozen_id_tree(frozen_id_tree&& other) = default;
+  frozen_id_tree& operator=(frozen_id_tree&& other) = default;
+
+  frozen_id_tree(const frozen_id_tree&) = delete;
+  frozen_id_tree& operator=(const frozen_id_tree&) = delete;
+
+  /// find the child of a node
+  /// @param node: the index of the node
+  /// @param id: the id of the child
+  /// @return the index of the child node, or NULL_IDX if not found
+  inline int32_t find(int32_t node, size_t id) const {
+    const auto first = _first_child[node];
+    const auto* ids = _ids + first;
+    const auto pos = detail::lower_bound_ids([ids](uint32_t i) { return ids[i]; }, _child_count[node], id);
+    if (pos == _child_count[node] || ids[pos] != id) return NULL_IDX;
+    return (int32_t)(first + pos);
+  }
+
+  /// find the node with the given ids
+  /// @param ids: the ids from the child of the root down to the node
+  /// @return the index of the node, or NULL_IDX if not found
+  template<typename T>
+  int32_t find(const T &ids) const
+  requires std::is_same_v<typename T::value_type, size_t> {
+    if (ids.empty() || !_size) return NULL_IDX;
+    int32_t node = ROOT;
+    for (auto i = ids.begin(); i < ids.end(); i++) {
+      node = find(node, *i);
+      if (node == NULL_IDX) return NULL_IDX;
+    }
+    return node;
+  }
+
+  /// get the count of nodes, including the root
+  inline size_t size() const { return _size; }
+
+  inline size_t id(int32_t node) const { return _ids[node]; }
+  inline size_t data(int32_t node) const { return _data[node]; }
+  inline uint32_t child_count(int32_t node) const { return _child_count[node]; }
+
+  /// get the child of a node
+  /// @param node: the index of the node
+  /// @param idx: the index of the child, in [0, child_count(node))
+  /// @return the index of the child node
+  inline int32_t child(int32_t node, uint32_t idx) const { return (int32_t)(_first_child[node] + idx); }
+
+private:
+  size_t _size = 0;
+  std::unique_ptr<uint64_t[]> _buffer; // [ids] [data] [first_child, child_count]
+  const uint64_t* _ids = nullptr;
+  const uint64_t* _data = nullptr;
+  const uint32_t* _first_child = nullptr;
+  const uint32_t* _child_count = nullptr;
+};
+
+/// id tree view
+/// navigates a serialized id tree in place, e.g. straight from a mapped chunk,
+/// so opening a tree costs nothing and no node is ever allocated.
+/// the layout is the one of frozen_id_tree with fixed-width little-endian fields:
+/// [magic(uint32)] [node_count(uint32)]
+/// [id(uint64) * node_count] [data(uint64) * node_count]
+/// [first_child(uint32) * node_count] [child_count(uint32) * node_count]
+class id_tree_view {
+public:
+  /// "IDT1" read as little-endian uint32
+  static constexpr uint32_t MAGIC = 0x31544449;
+  static constexpr size_t NULL_DATA = id_tree::NULL_DATA;
+  static constexpr int32_t NULL_IDX = id_tree::NULL_IDX;
+  static constexpr int32_t ROOT = 0;
+
+  /// serialize a tree into the view layout
+  /// @param tree: the tree to serialize
+  /// @param output: the output vector, the tree is appended to it
+  static void serialize(const id_tree &tree, std::vector<uint8_t> &output);
+
+public:
+  id_tree_view() = default;
+
+  /// @param buffer: the serialized tree, must outlive the view
+  /// @throw std::runtime_error if the header is malformed
+  explicit id_tree_view(std::span<const uint8_t> buffer);
+
+  /// find the child of a node
+  /// @param node: the index of the node
+  /// @param id: the id of the child
+  /// @return the index of the child node, or NULL_IDX if not found
+  inline int32_t find(int32_t node, size_t id) const {
+    const auto first = first_child(node);
+    const auto count = child_count(node);
+    if (first > _size || count > _size - first) return NULL_IDX; // 损坏的数据
+    const auto pos = detail::lower_bound_ids(
+      [this, first](uint32_t i) { return this->id(first + i); }, count, id);
+    if (pos == count || this->id(first + pos) != id) return NULL_IDX;
+    return (int32_t)(first + pos);
+  }
+
+  /// find the node with the given ids
+  /// @param ids: the ids from the child of the root down to the node
+  /// @return the index of the node, or NULL_IDX if not found
+  template<typename T>
+  int32_t find(const T &ids) const
+  requires std::is_same_v<typename T::value_type, size_t> {
+    if (ids.empty() || !_size) return NULL_IDX;
+    int32_t node = ROOT;
+    for (auto i = ids.begin(); i < ids.end(); i++) {
+      node = find(node, *i);
+      if (node == NULL_IDX) return NULL_IDX;
+    }
+    return node;
+  }
+
+  /// get the count of nodes, including the root
+  inline size_t size() const { return _size; }
+
+  inline size_t id(int32_t node) const { return read_bytes<uint64_t>(_nodes, node * sizeof(uint64_t)); }
+  inline size_t data(int32_t node) const { return read_bytes<uint64_t>(_nodes, (_size + node) * sizeof(uint64_t)); }
+  inline uint32_t child_count(int32_t node) const {
+    return read_bytes<uint32_t>(_nodes, _size * sizeof(uint64_t) * 2 + (_size + node) * sizeof(uint32_t));
+  }
+
+  /// get the child of a node
+  /// @param node: the index of the node
+  /// @param idx: the index of the child, in [0, child_count(node))
+  /// @return the index of the child node
+  inline int32_t child(int32_t node, uint32_t idx) const { return (int32_t)(first_child(node) + idx); }
+
+private:
+  static constexpr size_t HEADER_SIZE = sizeof(uint32_t) * 2;
+  static constexpr size_t NODE_SIZE = sizeof(uint64_t) * 2 + sizeof(uint32_t) * 2;
+
+  inline uint32_t first_child(int32_t node) const {
+    return read_bytes<uint32_t>(_nodes, _size * sizeof(uint64_t) * 2 + node * sizeof(uint32_t));
+  }
+
+  size_t _size = 0;
+  std::span<const uint8_t> _nodes;
+};
+
 /// chunk
-/// [header] [chunk1] [chunk2] ...
-/// header: [chunk_count(uint64)]
-///         [chunk1_id(uint64)] [chunk1_size(uint64)]
-///         [chunk2_id]         [chunk2_size]
-///         [chunk3_id]         [chunk3_size]
-///         ...
-/// chunk:  [data]
+/// [header] [chunk1] [chunk2] ... [trailer]
+/// header:  [chunk_count(uint64)] [flags(uint64)] [hot_size(uint64), if FLAG_HOT_SIZE]
+///          [chunk1_id(uint64)] [chunk1_offset(uint64)] [chunk1_size(uint64)] [chunk1_crc(uint64), if FLAG_CRC32C]
+///          [chunk2_id]         [chunk2_offset]         [chunk2_size]         [chunk2_crc]
+///          ...
+/// chunk:   [data]
+/// trailer: [header_offset(uint64)] [magic(uint64)]
+///
+/// offsets are absolute. appending writes new chunks, a fresh header and a fresh
+/// trailer after the existing bytes, readers always follow the last trailer.
+/// replaced chunks and old headers stay behind as dead space until compaction.
+///
+/// hot_size is the length of the prefix holding the header and the chunks laid out
+/// by build_options::hot_order, it is prefetched in one sequential read on open.
+///
+/// chunks with identical content are stored once, several ids then share one offset.
+///
+/// with FLAG_CRC32C each chunk is verified on its first `get`, a chunk failing
+/// verification reads as empty.
+///
+/// legacy archives without trailer are still readable:
+/// [chunk_count(uint64)] [chunk1_id(uint64)] [chunk1_size(uint64)] ... [data]
 class chunk {
 public:
+  /// "LUACHNK\x01" read as little-endian uint64
+  static constexpr uint64_t MAGIC = 0x014b4e484341554cull;
+
+  /// ids from RESERVED_ID upwards hold archive metadata
+  static constexpr uint64_t RESERVED_ID = 0xffffffffffffff00ull;
+  /// the module_index of the archive, see build_options::module_paths
+  static constexpr uint64_t MODULE_INDEX_ID = RESERVED_ID + 1;
+  /// the module path tree of the archive, in id_tree_view layout
+  static constexpr uint64_t TREE_ID = RESERVED_ID + 2;
+  /// the path parts of the tree, see path_part_collection::serialize
+  static constexpr uint64_t PATH_PARTS_ID = RESERVED_ID + 3;
+
+  /// header flags
+  static constexpr uint64_t FLAG_HOT_SIZE = 1 << 0;
+  static constexpr uint64_t FLAG_CRC32C = 1 << 1;
+
+  /// header entry of a chunk
+  struct entry {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc = 0;
+  };
+
+  /// parsed header of a chunk
+  struct header {
+    std::vector<entry> entries;
+    uint64_t hot_size = 0; // 0 if the archive has no hot prefix
+    uint64_t size = 0;     // bytes taken by the live header and trailer
+    bool checksum = false; // entries carry a crc32c
+  };
+
+  /// chunk build options
+  struct build_options {
+    /// ids laid out first and in this order, e.g. lua_custom_requirer::load_order.
+    /// the remaining chunks follow sorted by id
+    std::vector<uint64_t> hot_order;
+
+    /// store chunks with identical content once
+    bool deduplicate = true;
+
+    /// store a crc32c per chunk, verified on the first get
+    bool checksum = false;
+
+    /// full module path to chunk id, e.g. "game/ai/brain".
+    /// if not empty a module_index is built and stored at the head of the
+    /// hot prefix under MODULE_INDEX_ID
+    std::unordered_map<std::string, uint64_t> module_paths;
+  };
+
   /// build a chunk from a buffer map
   /// @param chunks: the chunks to build
   /// @return the chunk
@@ -194,6 +565,60 @@ public:
   static std::vector<uint8_t>
   build_chunk_buffer(std::unordered_map<uint64_t, std::span<uint8_t>> &chunks);
 
+  /// build a chunk buffer from a buffer map
+  /// @param chunks: the chunks to build
+  /// @param options: the layout options
+  /// @return the buffer
+  static std::vector<uint8_t>
+  build_chunk_buffer(std::unordered_map<uint64_t, std::span<uint8_t>> &chunks,
+                     const build_options &options);
+
+  /// append chunks to an archive file without rewriting it
+  /// the file is created if it does not exist
+  /// @param filename: the archive file
+  /// @param chunks: the new or replaced chunks
+  /// @param removed: the ids to drop from the archive
+  static void append_chunk_file(const std::string_view &filename,
+                                std::unordered_map<uint64_t, std::span<uint8_t>> &chunks,
+                                const std::vector<uint64_t> &removed = {});
+
+  /// rewrite an archive file keeping only the live chunks
+  /// @param filename: the archive file
+  static void compact_chunk_file(const std::string_view &filename);
+
+  /// read the live header of an archive
+  /// @param read: reads size bytes at offset into the output span
+  /// @param total_size: the size of the archive
+  /// @return the live header of the archive
+  /// @throw std::runtime_error if the archive is malformed
+  static header read_header(
+      const std::function<void(uint64_t offset, std::span<uint8_t> out)> &read,
+      uint64_t total_size);
+
+  /// wrap an archive without copying or taking ownership, e.g. one embedded
+  /// into the binary by lua_embed. the buffer is never written or freed
+  /// @param buffer: the archive, must outlive the chunk
+  /// @throw std::runtime_error if the archive is malformed
+  static chunk borrow(std::span<const uint8_t> buffer);
+
+  /// wrap an archive with an index built ahead of time, the header is not parsed
+  /// and no map is built, `get` binary searches entries with find_entry
+  /// @param buffer: the archive, must outlive the chunk
+  /// @param entries: the live entries of the archive sorted by id, must outlive the chunk
+  /// @param checksum: the entries carry a crc32c
+  /// @throw std::runtime_error if an entry is out of the buffer or entries are not sorted
+  static chunk borrow(std::span<const uint8_t> buffer, std::span<const entry> entries, bool checksum);
+
+  /// find an entry in entries sorted by id, usable at compile time
+  /// @param entries: the entries sorted by id
+  /// @param id: the id of the chunk
+  /// @return the entry, or nullptr if not found
+  static constexpr const entry* find_entry(std::span<const entry> entries, uint64_t id) {
+    const auto it = std::lower_bound(entries.begin(), entries.end(), id,
+      [](const entry &e, uint64_t id) { return e.id < id; });
+    return it != entries.end() && it->id == id ? &*it : nullptr;
+  }
+
 public:
   chunk();
   chunk(const std::string_view &filename);
@@ -209,22 +634,227 @@ public:
 
   /// get a chunk by id
   /// @param id: the id of the chunk
-  /// @return the chunk
-  inline const std::span<uint8_t> get(size_t id) const {
-    if (!_buffer) return {};
-    if (!_data_map.contains(id)) return {};
-    return _data_map.at(id);
+  /// @return the chunk, empty if not found or if it fails verification
+  inline std::span<const uint8_t> get(size_t id) const {
+    if (!_entries.empty()) {
+      const auto* e = find_entry(_entries, id);
+      return e ? checked({ { _buffer + e->offset, e->size }, e->crc, (uint32_t)(e - _entries.data()) }) : std::span<const uint8_t>();
+    }
+    const auto it = _data_map.find(id);
+    if (it == _data_map.end()) return {};
+    return checked(it->second);
   }
 
+  /// check if a chunk exists, verified or not
+  /// @param id: the id of the chunk
+  inline bool contains(size_t id) const {
+    return _entries.empty() ? _data_map.contains(id) : find_entry(_entries, id) != nullptr;
+  }
+
+  /// check if the chunks carry checksums
+  inline bool checksummed() const { return _checksum; }
+
   /// get the raw buffer
-  inline const std::span<uint8_t> get_raw() const { return { _buffer, _buffer_size }; }
+  inline std::span<const uint8_t> get_raw() const { return { _buffer, _buffer_size }; }
+
+  /// get the bytes not referenced by the live header
+  /// @return the size of replaced chunks and old headers
+  inline size_t dead_size() const { return _dead_size; }
+
+  /// get the count of chunks
+  inline size_t size() const { return _entries.empty() ? _data_map.size() : _entries.size(); }
+
+  /// get the length of the hot prefix
+  inline size_t hot_size() const { return _hot_size; }
+
+  /// ask the os to read the hot prefix ahead in one sequential pass
+  /// called on open for mapped archives, a no-op for in-memory ones
+  void prefetch_hot() const;
+
+  /// for each chunk, without verification
+  /// @param func: the function to call for each chunk
+  void for_each(const std::function<void(size_t id, std::span<const uint8_t> data)> &func) const;
 
 private:
+  /// where the buffer comes from, decides how it is released
+  enum class storage : uint8_t {
+    owned,    // new[] buffer
+    mapped,   // private file mapping
+    borrowed, // caller's memory, e.g. embedded in the binary, never freed
+  };
+
+  /// a chunk in the map
+  struct slot {
+    std::span<const uint8_t> data;
+    uint32_t crc;
+    uint32_t index; // position in the verification bitset
+  };
+
+  /// verification state, 2 bits per chunk
+  static constexpr uint64_t UNVERIFIED = 0;
+  static constexpr uint64_t VERIFIED = 1;
+  static constexpr uint64_t CORRUPTED = 2;
+
+  inline std::span<const uint8_t> checked(const slot &s) const {
+    if (!_checksum) return s.data;
+    const auto state = (_verify_bits[s.index / 32].load(std::memory_order_relaxed) >> (s.index % 32 * 2)) & 3;
+    if (state == VERIFIED) return s.data;
+    if (state == CORRUPTED) return {};
+    return verify(s);
+  }
+
+  std::span<const uint8_t> verify(const slot &s) const;
   void build_buffer_map(); // only call by constructor
+  void build_buffer_map_or_release(); // build_buffer_map, releasing the buffer if it throws
+  void build_data_map(std::span<const entry> entries, bool checksum, uint64_t header_size);
+  void init_verify_bits(size_t count, bool checksum);
+  void release();
+
+  friend class chunk_stack;
 
-  uint8_t* _buffer;
+  const uint8_t* _buffer; // never written, borrowed storage may be read-only
   size_t _buffer_size;
-  std::unordered_map<size_t, std::span<uint8_t>> _data_map;
+  size_t _dead_size;
+  size_t _hot_size;
+  storage _storage;
+  bool _checksum;
+  std::unordered_map<size_t, slot> _data_map;
+  std::span<const entry> _entries; // a prebuilt index sorted by id, used instead of _data_map
+  std::unique_ptr<std::atomic<uint64_t>[]> _verify_bits;
+};
+
+/// chunk stack
+/// chunk_stack layers several chunks, e.g. a base archive and ordered patch archives.
+/// later layers shadow earlier ones, and all lookups go through one index merged
+/// when a layer is pushed, so `get` costs one hash lookup whatever the depth.
+class chunk_stack {
+public:
+  chunk_stack() = default;
+  chunk_stack(chunk &&base);
+  chunk_stack(std::vector<chunk> &&layers);
+
+  chunk_stack(chunk_stack&& other) = default;
+  chunk_stack& operator=(chunk_stack&& other) = default;
+
+  chunk_stack(const chunk_stack&) = delete;
+  chunk_stack& operator=(const chunk_stack&) = delete;
+
+  /// push a layer on top of the stack
+  /// @param layer: the layer, its chunks shadow the chunks with the same id below
+  void push(chunk &&layer);
+
+  /// get a chunk by id from the topmost layer containing it
+  /// @param id: the id of the chunk
+  /// @return the chunk
+  inline std::span<const uint8_t> get(size_t id) const {
+    const auto it = _data_map.find(id);
+    if (it == _data_map.end()) return {};
+    const auto &[layer, s] = it->second;
+    return _layers[layer].checked(s);
+  }
+
+  /// check if a chunk exists in any layer, verified or not
+  /// @param id: the id of the chunk
+  inline bool contains(size_t id) const { return _data_map.contains(id); }
+
+  /// get the count of visible chunks
+  inline size_t size() const { return _data_map.size(); }
+
+  /// get the count of layers
+  inline size_t layer_count() const { return _layers.size(); }
+
+  /// get a layer
+  /// @param idx: the index of the layer, 0 is the base
+  inline const chunk& layer(size_t idx) const { return _layers.at(idx); }
+
+  /// move the layers out, leaving the stack empty
+  /// @return the layers, the base first
+  std::vector<chunk> release();
+
+private:
+  // chunk 移动时 buffer 地址不变, 合并索引中的 span 始终有效
+  std::vector<chunk> _layers;
+  std::unordered_map<size_t, std::pair<uint32_t, chunk::slot>> _data_map;
+};
+
+namespace detail {
+
+/// minimal perfect hash over distinct string keys (hash and displace).
+/// keys are hashed into buckets of about 4, and each bucket, largest first,
+/// gets the first displacement that sends all its keys to free slots.
+struct perfect_hash {
+  uint32_t seed = 0;
+  std::vector<uint32_t> displacements;
+  std::vector<uint32_t> slots; // slot of each key, in input order
+
+  /// build a perfect hash
+  /// @param keys: the keys, must be distinct
+  /// @throw std::runtime_error if no hash is found
+  static perfect_hash build(const std::vector<std::string_view> &keys);
+
+  static inline uint32_t bucket(uint64_t hash, uint32_t bucket_count) {
+    return (uint32_t)(((hash >> 32) * bucket_count) >> 32);
+  }
+
+  static inline uint32_t slot(uint64_t hash, uint32_t displacement, uint32_t key_count) {
+    uint64_t x = hash ^ (displacement * 0x9E3779B97F4A7C15ull);
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 29;
+    return (uint32_t)(((x & 0xffffffff) * key_count) >> 32);
+  }
+};
+
+} // namespace detail
+
+/// module index
+/// a minimal perfect hash from full module paths to chunk ids. it is built
+/// with the archive and read in place, so resolving a module costs one hash
+/// and one compare, with no tokenizing and nothing built at startup.
+/// [magic(uint32)] [key_count(uint32)] [bucket_count(uint32)] [seed(uint32)]
+/// [displacement(uint32) * bucket_count]
+/// [chunk_id(uint64)] [name_offset(uint32)] [name_size(uint32)] * key_count
+/// [names]
+class module_index {
+public:
+  /// "MPH1" read as little-endian uint32
+  static constexpr uint32_t MAGIC = 0x3148504d;
+  static constexpr uint64_t NULL_ID = id_tree::NULL_DATA;
+
+  /// build a module index
+  /// @param modules: full module path to chunk id
+  /// @return the serialized index
+  static std::vector<uint8_t> build(const std::unordered_map<std::string, uint64_t> &modules);
+
+public:
+  module_index() = default;
+
+  /// @param buffer: the serialized index, must outlive the index
+  /// @throw std::runtime_error if the buffer is malformed
+  explicit module_index(std::span<const uint8_t> buffer);
+
+  /// find the chunk of a module
+  /// @param path: the full module path
+  /// @return the chunk id, or NULL_ID if not found
+  uint64_t find(std::string_view path) const;
+
+  /// get the count of modules
+  inline size_t size() const { return _key_count; }
+
+  /// for each module
+  /// @param func: the function to call for each module path and chunk id
+  void for_each(const std::function<void(std::string_view path, uint64_t chunk_id)> &func) const;
+
+private:
+  static constexpr size_t HEADER_SIZE = sizeof(uint32_t) * 4;
+  static constexpr size_t SLOT_SIZE = sizeof(uint64_t) + sizeof(uint32_t) * 2;
+
+  uint32_t _key_count = 0;
+  uint32_t _bucket_count = 0;
+  uint32_t _seed = 0;
+  std::span<const uint8_t> _displacements;
+  std::span<const uint8_t> _slots;
+  std::span<const uint8_t> _names;
 };
 
 /// path part collection
@@ -241,6 +871,11 @@ public:
   static void
   enumerate_path(const std::string_view &path, std::function<void(const std::string_view &)> func);
 
+  /// path part collection deserializer
+  /// @param buffer: [count(uint32)] then [id(uint64)] [size(uint32)] [part] * count
+  /// @throw std::runtime_error if the buffer is malformed
+  static path_part_collection deserialize(std::span<const uint8_t> buffer);
+
 public:
   /// add a path part
   /// @param path_part: the path part to add
@@ -252,21 +887,251 @@ public:
   /// @return the ids of the path
   std::vector<size_t> to_ids(const std::string_view &path) const;
 
+  /// convert ids to a path, parts joined by '/'
+  /// @param ids: the ids of the path parts
+  /// @return the path
+  /// @throw std::runtime_error if an id is not found
+  std::string to_path(std::span<const size_t> ids) const;
+
+  /// path part collection serializer
+  /// @param output: the output vector, the parts are appended to it
+  void serialize(std::vector<uint8_t> &output) const;
+
+  /// get the count of path parts
+  inline size_t size() const { return _map.size(); }
+
 private:
-  std::unordered_map<std::string_view, size_t> _map;
+  std::unordered_map<std::string, size_t, detail::string_hash, std::equal_to<>> _map;
+  std::unordered_map<size_t, std::string_view> _parts; // id to the key in _map
 };
 
+/// lua custom requirer
+/// loads lua modules from lua_src_chunk, module names are resolved through
+/// lua_src_path_collection and lua_src_tree whose node data is the chunk id.
+/// resolved names, found or not, are cached with spans into lua_src_chunk, so
+/// lua_src_* are only replaced through setters that drop the cache.
 class lua_custom_requirer {
 public:
+  /// a chunk loaded by require while recording
+  struct load_record {
+    uint64_t chunk_id;
+    std::string module_name; // as passed to require
+    uint64_t start_ns; // since start_recording
+    uint64_t load_ns;  // spent in luaL_loadbuffer
+  };
+
+  /// modules touched by a reload
+  struct reload_result {
+    std::vector<std::string> changed; // changed or removed, dropped from package.loaded
+    std::vector<std::pair<std::string, std::string>> failed; // re-required with an error: name, error
+  };
+
+  /// require statistics of one module
+  struct module_stats {
+    uint64_t loads = 0;
+    uint64_t bytes = 0;
+    uint64_t load_ns = 0; // spent in luaL_loadbuffer
+  };
+
+  /// require statistics of a requirer
+  struct stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t bytes = 0;
+    uint64_t load_ns = 0; // spent in luaL_loadbuffer
+  };
+
   static void register_requirer(lua_State *L, int(*requirer)(lua_State*));
 
-public:
-  id_tree lua_src_tree;
-  chunk lua_src_chunk;
-  path_part_collection lua_src_path_collection;
+  /// get the first-touch order of recorded chunks
+  /// @param records: the records returned by stop_recording
+  /// @return the chunk ids, for chunk::build_options::hot_order
+  static std::vector<uint64_t> load_order(const std::vector<load_record> &records);
+
+  /// get the first-touch order of recorded modules
+  /// @param records: the records returned by stop_recording
+  /// @return the module names, one per line of a lua-pack --hot-order file
+  static std::vector<std::string> load_order_names(const std::vector<load_record> &records);
 
 public:
+  /// get the chunks modules are loaded from
+  inline const chunk_stack &lua_src_chunk() const { return _lua_src_chunk; }
+
+  /// replace the chunks and clear the cache, see reload to keep loaded modules in sync
+  /// @param chunks: the new chunks
+  void set_lua_src_chunk(chunk_stack &&chunks);
+
+  /// get the path tree, node data is the chunk id
+  inline const id_tree &lua_src_tree() const { return _lua_src_tree; }
+
+  /// replace the path tree and clear the cache
+  /// @param tree: the new tree
+  void set_lua_src_tree(id_tree &&tree);
+
+  /// get the path parts of the tree
+  inline const path_part_collection &lua_src_path_collection() const { return _lua_src_path_collection; }
+
+  /// replace the path parts and clear the cache
+  /// @param parts: the new path parts
+  void set_lua_src_path_collection(path_part_collection &&parts);
+
+  /// register this requirer as the first searcher of L
+  /// the requirer is bound as an upvalue, so it must outlive L
+  void register_requirer(lua_State *L);
+
+  /// the searcher, returns a loader, or a message if the module is not in the archive
+  /// a module already resolved loads straight from the cache; otherwise a module in
+  /// package.preload is left to the preload searcher
   int require(lua_State *L);
+
+  /// register lazy_require as a global function of L
+  /// the requirer is bound as an upvalue, so it must outlive L
+  /// @param name: the name of the global
+  void register_lazy_require(lua_State *L, const char* name = "lazy_require");
+
+  /// lazy_require(name), returns a proxy of a module in the archive that is
+  /// required on the first field access, call, pairs or length. after that the
+  /// proxy forwards to the module through its metatable, with no C call.
+  /// loaded modules and modules not in the archive are required at once
+  int lazy_require(lua_State *L);
+
+  /// get the statistics since construction or reset_stats
+  inline const stats &get_stats() const { return _stats; }
+
+  /// for each module loaded
+  /// @param func: the function to call for each module name and its statistics
+  void for_each_module_stats(
+      const std::function<void(std::string_view module_name, const module_stats &stats)> &func) const;
+
+  /// reset the statistics
+  void reset_stats();
+
+  /// start recording the chunks loaded by require
+  void start_recording();
+
+  /// stop recording
+  /// @return the records in load order
+  std::vector<load_record> stop_recording();
+
+  /// forget every resolved module name
+  void clear_cache();
+
+  /// enumerate the modules under a path prefix, e.g. "game/ai"
+  /// walks the subtree of lua_src_tree, or the module index if the tree has no such node
+  /// @param prefix: the path prefix, empty for every module
+  /// @return the module names and chunk ids, sorted by name
+  std::vector<std::pair<std::string, uint64_t>> enumerate(std::string_view prefix);
+
+  /// load every module under a path prefix into package.preload in one batch
+  /// chunks are loaded in archive order, so the archive is read sequentially.
+  /// modules already loaded or preloaded are skipped, the preloaded ones are
+  /// remembered so reload can rebuild or drop their package.preload entries
+  /// @param L: the lua state
+  /// @param prefix: the path prefix, empty for every module
+  /// @return the count of modules loaded
+  /// @throw std::runtime_error if a chunk fails to load
+  size_t preload(lua_State *L, std::string_view prefix);
+
+  /// replace lua_src_chunk and invalidate the modules whose chunk changed
+  /// modules resolved or preloaded before are compared byte by byte with the new
+  /// archive, the changed or removed ones are dropped from package.loaded and, if
+  /// asked and they were loaded, required again. their package.preload entries are
+  /// rebuilt from the new chunk, or removed. unchanged modules keep their state
+  /// @param L: the lua state
+  /// @param chunks: the new chunks
+  /// @param re_require: require the changed modules again
+  /// @return the changed modules and the failed re-requires
+  reload_result reload(lua_State *L, chunk_stack &&chunks, bool re_require = false);
+
+  /// reopen the base archive file, see reload
+  /// only the base layer of lua_src_chunk is replaced, the patch layers stay on top.
+  /// the old base may be mapped, so replace the file by renaming a new one over it
+  /// @param filename: the archive file
+  /// @throw std::runtime_error if the archive cannot be opened, lua_src_chunk is unchanged
+  reload_result reload(lua_State *L, const std::string_view &filename, bool re_require = false);
+
+private:
+  /// upper bound of cached misses, so arbitrary names cannot grow the cache forever
+  static constexpr size_t MAX_CACHED_MISSES = 4096;
+
+  /// a resolved module name, chunk_id is id_tree::NULL_DATA for a miss
+  struct resolved {
+    uint64_t chunk_id;
+    std::span<const uint8_t> chunk;
+    const char* error;
+  };
+
+  resolved resolve(std::string_view module_name);
+
+  id_tree _lua_src_tree;
+  chunk_stack _lua_src_chunk;
+  path_part_collection _lua_src_path_collection;
+
+  // 以名字为键而非 lua 字符串指针: resolve 不依赖 lua_State, 且长字符串不会被内部化
+  std::unordered_map<std::string, resolved, detail::string_hash, std::equal_to<>> _resolved;
+  size_t _cached_misses = 0;
+
+  // preload 写入 package.preload 的模块, 值为加载时的 chunk
+  std::unordered_map<std::string, std::span<const uint8_t>, detail::string_hash, std::equal_to<>> _preloaded;
+
+  module_index _module_index; // read from lua_src_chunk on first resolve
+  bool _module_index_loaded = false;
+
+  bool _recording = false;
+  std::chrono::steady_clock::time_point _record_begin;
+  std::vector<load_record> _records;
+
+  stats _stats;
+  std::unordered_map<std::string, module_stats, detail::string_hash, std::equal_to<>> _module_stats;
+
+  static int searcher(lua_State *L);
+  static int lazy_require_closure(lua_State *L);
+};
+
+/// module archive
+/// an immutable set of lua modules that any number of states on any threads can
+/// load from. states hold it through a shared_ptr that is released when the state
+/// is closed, so the index and payload are paid once per process, not per state.
+/// lookups never write, so no locking is needed; chunk verification is atomic.
+class module_archive {
+public:
+  /// register an archive as the first searcher of L
+  /// @param L: the lua state, holds a reference to the archive until closed
+  /// @param archive: the archive
+  static void register_searcher(lua_State *L, std::shared_ptr<const module_archive> archive);
+
+public:
+  /// @param chunks: the module chunks
+  /// @param tree: the path tree, node data is the chunk id
+  /// @param parts: the path parts of the tree
+  module_archive(chunk_stack &&chunks, const id_tree &tree, path_part_collection &&parts);
+
+  /// open an archive built by lua-pack, the tree and path parts are read
+  /// from the TREE_ID and PATH_PARTS_ID chunks
+  /// @param chunks: the module chunks
+  /// @throw std::runtime_error if the metadata is missing or malformed
+  explicit module_archive(chunk_stack &&chunks);
+
+  module_archive(const module_archive&) = delete;
+  module_archive& operator=(const module_archive&) = delete;
+
+  /// find a module
+  /// @param module_name: the module name
+  /// @return the chunk id, or id_tree::NULL_DATA if not found
+  uint64_t find(std::string_view module_name) const;
+
+  /// get the chunks
+  inline const chunk_stack &chunks() const { return _chunks; }
+
+private:
+  static int searcher(lua_State *L);
+  static int gc(lua_State *L);
+
+  chunk_stack _chunks;
+  frozen_id_tree _tree;
+  id_tree_view _tree_view; // used instead of _tree when opened from metadata
+  path_part_collection _parts;
+  module_index _index;
 };
 
 }
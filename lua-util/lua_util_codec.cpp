@@ -0,0 +1,320 @@
+#include <bit>
+#include <string>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+#include "lua_util_chunk.h"
+#include "lua_util_codec.h"
+
+using value_codec = lua_util::value_codec;
+
+static void write_varint(std::vector<uint8_t> &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((uint8_t)value);
+}
+
+static void patch_u32(std::vector<uint8_t> &out, size_t offset, uint32_t value) {
+  lua_util::write_bytes(std::span<uint8_t>(out), value, offset);
+}
+
+namespace {
+
+/// encoder state, tables and dictionary strings are numbered in first-seen order
+class value_encoder {
+public:
+  value_encoder(lua_State *L, std::vector<uint8_t> &out) : _L(L), _out(out) {}
+
+  void encode(int idx, int depth) {
+    switch (lua_type(_L, idx)) {
+    case LUA_TNIL:
+      _out.push_back(value_codec::NIL);
+      break;
+    case LUA_TBOOLEAN:
+      _out.push_back(lua_toboolean(_L, idx) ? value_codec::TRUE : value_codec::FALSE);
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(_L, idx)) {
+        const auto value = (uint64_t)lua_tointeger(_L, idx);
+        _out.push_back(value_codec::INTEGER);
+        write_varint(_out, (value << 1) ^ (uint64_t)((int64_t)value >> 63)); // zigzag
+      } else {
+        _out.push_back(value_codec::FLOAT);
+        lua_util::write_bytes(_out, std::bit_cast<uint64_t>((double)lua_tonumber(_L, idx)));
+      }
+      break;
+    case LUA_TSTRING:
+      encode_string(idx);
+      break;
+    case LUA_TTABLE:
+      encode_table(idx, depth);
+      break;
+    default:
+      throw std::runtime_error(std::string("value_codec: cannot encode a ") + luaL_typename(_L, idx));
+    }
+  }
+
+private:
+  void encode_string(int idx) {
+    size_t size = 0;
+    const char* data = lua_tolstring(_L, idx, &size);
+    const auto str = std::string_view(data, size);
+    if (size >= value_codec::DICT_MIN_SIZE) {
+      // lua 字符串在值存活期间地址不变, 直接用作键
+      const auto [it, inserted] = _strings.try_emplace(str, (uint32_t)_strings.size());
+      if (!inserted) {
+        _out.push_back(value_codec::STRING_REF);
+        write_varint(_out, it->second);
+        return;
+      }
+    }
+    _out.push_back(value_codec::STRING);
+    write_varint(_out, size);
+    _out.insert(_out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+  }
+
+  void encode_table(int idx, int depth) {
+    const void* ptr = lua_topointer(_L, idx);
+    const auto [it, inserted] = _tables.try_emplace(ptr, (uint32_t)_tables.size());
+    if (!inserted) {
+      _out.push_back(value_codec::TABLE_REF);
+      write_varint(_out, it->second);
+      return;
+    }
+    if (depth >= value_codec::MAX_DEPTH) throw std::runtime_error("value_codec: table nested too deep");
+    if (!lua_checkstack(_L, 4)) throw std::runtime_error("value_codec: lua stack overflow");
+
+    idx = lua_absindex(_L, idx);
+    const auto array_size = (uint32_t)lua_rawlen(_L, idx);
+    _out.push_back(value_codec::TABLE);
+    lua_util::write_bytes(_out, array_size);
+    const auto hash_size_offset = _out.size();
+    lua_util::write_bytes(_out, (uint32_t)0);
+
+    // 1. 数组部分按顺序写入, 空洞写为 nil
+    for (uint32_t i = 1; i <= array_size; i++) {
+      lua_rawgeti(_L, idx, i);
+      encode(-1, depth + 1);
+      lua_pop(_L, 1);
+    }
+
+    // 2. 其余键值对, 跳过数组部分已写入的键
+    uint32_t hash_size = 0;
+    lua_pushnil(_L);
+    while (lua_next(_L, idx)) {
+      if (lua_isinteger(_L, -2)) {
+        const auto key = lua_tointeger(_L, -2);
+        if (key >= 1 && (lua_Unsigned)key <= array_size) {
+          lua_pop(_L, 1);
+          continue;
+        }
+      }
+      encode(-2, depth + 1);
+      encode(-1, depth + 1);
+      lua_pop(_L, 1);
+      hash_size++;
+    }
+    patch_u32(_out, hash_size_offset, hash_size);
+  }
+
+  lua_State* _L;
+  std::vector<uint8_t> &_out;
+  std::unordered_map<const void*, uint32_t> _tables;
+  std::unordered_map<std::string_view, uint32_t> _strings;
+};
+
+/// decoder state, decoded tables are kept in a lua table at _tables for TABLE_REF
+class value_decoder {
+public:
+  value_decoder(lua_State *L, std::span<const uint8_t> in, int tables) : _L(L), _in(in), _tables(tables) {}
+
+  void decode(int depth) {
+    if (!lua_checkstack(_L, 4)) throw std::runtime_error("value_codec: lua stack overflow");
+
+    switch (read_u8()) {
+    case value_codec::NIL:
+      lua_pushnil(_L);
+      break;
+    case value_codec::FALSE:
+      lua_pushboolean(_L, 0);
+      break;
+    case value_codec::TRUE:
+      lua_pushboolean(_L, 1);
+      break;
+    case value_codec::INTEGER: {
+      const auto value = read_varint();
+      lua_pushinteger(_L, (lua_Integer)((value >> 1) ^ (~(value & 1) + 1)));
+      break;
+    }
+    case value_codec::FLOAT:
+      lua_pushnumber(_L, (lua_Number)std::bit_cast<double>(read<uint64_t>()));
+      break;
+    case value_codec::STRING: {
+      const auto size = read_varint();
+      if (size > _in.size() - _pos) throw std::runtime_error("value_codec: truncated string");
+      const auto str = std::string_view((const char*)_in.data() + _pos, size);
+      _pos += size;
+      if (size >= value_codec::DICT_MIN_SIZE) _strings.push_back(str);
+      lua_pushlstring(_L, str.data(), str.size());
+      break;
+    }
+    case value_codec::STRING_REF: {
+      const auto idx = read_varint();
+      if (idx >= _strings.size()) throw std::runtime_error("value_codec: invalid string reference");
+      lua_pushlstring(_L, _strings[idx].data(), _strings[idx].size());
+      break;
+    }
+    case value_codec::TABLE:
+      decode_table(depth);
+      break;
+    case value_codec::TABLE_REF: {
+      const auto idx = read_varint();
+      if (idx >= _table_count) throw std::runtime_error("value_codec: invalid table reference");
+      lua_rawgeti(_L, _tables, (lua_Integer)idx + 1);
+      break;
+    }
+    default:
+      throw std::runtime_error("value_codec: invalid tag");
+    }
+  }
+
+  inline bool done() const { return _pos == _in.size(); }
+
+private:
+  void decode_table(int depth) {
+    if (depth >= value_codec::MAX_DEPTH) throw std::runtime_error("value_codec: table nested too deep");
+    const auto array_size = read<uint32_t>();
+    const auto hash_size = read<uint32_t>();
+
+    // 每个元素至少一个字节, 据此拒绝伪造的超大尺寸
+    const auto remaining = _in.size() - _pos;
+    if (array_size > remaining || hash_size > remaining / 2)
+      throw std::runtime_error("value_codec: truncated table");
+
+    lua_createtable(_L, (int)std::min<uint32_t>(array_size, INT_MAX), (int)std::min<uint32_t>(hash_size, INT_MAX));
+    const int table = lua_gettop(_L);
+
+    // 先登记再填充, 子表可以引用正在构建的表
+    lua_pushvalue(_L, table);
+    lua_rawseti(_L, _tables, (lua_Integer)++_table_count);
+
+    for (uint32_t i = 1; i <= array_size; i++) {
+      decode(depth + 1);
+      lua_rawseti(_L, table, i);
+    }
+    for (uint32_t i = 0; i < hash_size; i++) {
+      decode(depth + 1);
+      if (lua_isnil(_L, -1)) throw std::runtime_error("value_codec: nil table key");
+      if (lua_type(_L, -1) == LUA_TNUMBER && lua_tonumber(_L, -1) != lua_tonumber(_L, -1))
+        throw std::runtime_error("value_codec: nan table key");
+      decode(depth + 1);
+      lua_rawset(_L, table);
+    }
+  }
+
+  uint8_t read_u8() {
+    if (_pos >= _in.size()) throw std::runtime_error("value_codec: truncated value");
+    return _in[_pos++];
+  }
+
+  template<typename T>
+  T read() {
+    if (_in.size() - _pos < sizeof(T)) throw std::runtime_error("value_codec: truncated value");
+    const auto value = lua_util::read_bytes<T>(_in, _pos);
+    _pos += sizeof(T);
+    return value;
+  }
+
+  uint64_t read_varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      const auto byte = read_u8();
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("value_codec: invalid varint");
+  }
+
+  lua_State* _L;
+  std::span<const uint8_t> _in;
+  size_t _pos = 0;
+  int _tables;
+  uint64_t _table_count = 0;
+  std::vector<std::string_view> _strings;
+};
+
+}
+
+void lua_util::value_codec::encode(lua_State *L, int idx, std::vector<uint8_t> &output) {
+  const int top = lua_gettop(L);
+  idx = lua_absindex(L, idx);
+  const auto begin = output.size();
+  try {
+    output.push_back(VERSION);
+    value_encoder(L, output).encode(idx, 0);
+  } catch (...) {
+    output.resize(begin);
+    lua_settop(L, top);
+    throw;
+  }
+}
+
+std::vector<uint8_t> lua_util::value_codec::encode(lua_State *L, int idx) {
+  auto result = std::vector<uint8_t>();
+  encode(L, idx, result);
+  return result;
+}
+
+void lua_util::value_codec::decode(lua_State *L, std::span<const uint8_t> buffer) {
+  if (buffer.empty() || buffer[0] != VERSION) throw std::runtime_error("value_codec: unsupported version");
+
+  const int top = lua_gettop(L);
+  try {
+    if (!lua_checkstack(L, 2)) throw std::runtime_error("value_codec: lua stack overflow");
+    lua_newtable(L); // 已解码的表
+    auto decoder = value_decoder(L, buffer.subspan(1), top + 1);
+    decoder.decode(0);
+    if (!decoder.done()) throw std::runtime_error("value_codec: trailing bytes");
+    lua_remove(L, top + 1);
+  } catch (...) {
+    lua_settop(L, top);
+    throw;
+  }
+}
+
+int lua_util::value_codec::lua_encode(lua_State *L) {
+  luaL_checkany(L, 1);
+
+  // 错误信息先压栈, C++ 对象析构后再抛出 lua 错误
+  bool ok = true;
+  {
+    auto output = std::vector<uint8_t>();
+    try {
+      encode(L, 1, output);
+      lua_pushlstring(L, (const char*)output.data(), output.size());
+    } catch (const std::runtime_error &e) {
+      lua_pushstring(L, e.what());
+      ok = false;
+    }
+  }
+  return ok ? 1 : lua_error(L);
+}
+
+int lua_util::value_codec::lua_decode(lua_State *L) {
+  size_t size = 0;
+  const char* data = luaL_checklstring(L, 1, &size);
+
+  bool ok = true;
+  try {
+    decode(L, { (const uint8_t*)data, size });
+  } catch (const std::runtime_error &e) {
+    lua_pushstring(L, e.what());
+    ok = false;
+  }
+  return ok ? 1 : lua_error(L);
+}
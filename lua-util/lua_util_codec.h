@@ -0,0 +1,71 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <span>
+#include <vector>
+#include <cstdint>
+
+namespace lua_util {
+
+/// lua value codec
+/// a compact binary form of lua values: nil, booleans, integers, floats, strings
+/// and tables nested in any shape. a table referenced twice, cycles included, is
+/// encoded once and referenced after, and strings of DICT_MIN_SIZE bytes or more
+/// are stored once and referenced after. metatables are not encoded, functions,
+/// userdata and threads are rejected.
+/// [version(uint8)] [value]
+/// value:
+///   [NIL] [FALSE] [TRUE]
+///   [INTEGER] [zigzag varint]     [FLOAT] [float64]
+///   [STRING] [size varint] [bytes] [STRING_REF] [dictionary index varint]
+///   [TABLE] [array_size(uint32)] [hash_size(uint32)] [value * array_size] [key value * hash_size]
+///   [TABLE_REF] [table index varint]
+class value_codec {
+public:
+  static constexpr uint8_t VERSION = 1;
+
+  /// strings shorter than this are always written inline
+  static constexpr size_t DICT_MIN_SIZE = 4;
+
+  /// tables nested deeper than this are rejected
+  static constexpr int MAX_DEPTH = 200;
+
+  enum tag : uint8_t {
+    NIL = 0,
+    FALSE = 1,
+    TRUE = 2,
+    INTEGER = 3,
+    FLOAT = 4,
+    STRING = 5,
+    STRING_REF = 6,
+    TABLE = 7,
+    TABLE_REF = 8,
+  };
+
+public:
+  /// encode the value at idx
+  /// @param L: the lua state, the stack is left unchanged
+  /// @param idx: the index of the value
+  /// @param output: the output vector, the value is appended to it
+  /// @throw std::runtime_error if the value cannot be encoded or nests too deep
+  static void encode(lua_State *L, int idx, std::vector<uint8_t> &output);
+
+  /// encode the value at idx
+  /// @return the encoded value
+  static std::vector<uint8_t> encode(lua_State *L, int idx);
+
+  /// decode a value and push it
+  /// @param L: the lua state
+  /// @param buffer: the encoded value
+  /// @throw std::runtime_error if the buffer is malformed, nothing is pushed then
+  static void decode(lua_State *L, std::span<const uint8_t> buffer);
+
+  /// lua: encode(value) -> string
+  static int lua_encode(lua_State *L);
+
+  /// lua: decode(string) -> value
+  static int lua_decode(lua_State *L);
+};
+
+}
@@ -0,0 +1,439 @@
+#include <bit>
+#include <new>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+#include "lua_util_chunk.h"
+#include "lua_util_static_table.h"
+
+using static_table = lua_util::static_table;
+
+constexpr size_t STATIC_HEADER_SIZE = sizeof(uint32_t) * 2 + sizeof(uint64_t) * 3;
+constexpr size_t STATIC_TABLE_HEADER_SIZE = sizeof(uint32_t) * 4;
+constexpr size_t STATIC_VALUE_SIZE = sizeof(uint64_t) * 2;
+constexpr size_t STATIC_ENTRY_SIZE = sizeof(uint32_t) * 2 + STATIC_VALUE_SIZE;
+
+static constexpr size_t align8(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static constexpr size_t table_size(uint64_t array_count, uint64_t key_count, uint64_t bucket_count) {
+  return STATIC_TABLE_HEADER_SIZE + array_count * STATIC_VALUE_SIZE +
+    align8(bucket_count * sizeof(uint32_t)) + key_count * STATIC_ENTRY_SIZE;
+}
+
+namespace {
+
+/// writes tables depth first, a table's slots are reserved before its children
+/// are written so shared tables and cycles resolve to one offset
+class static_table_builder {
+public:
+  explicit static_table_builder(lua_State *L) : _L(L) { _out.resize(STATIC_HEADER_SIZE); }
+
+  std::vector<uint8_t> build(int idx) {
+    const auto root = write_table(idx, 0);
+
+    _out.resize(align8(_out.size()));
+    const auto strings_offset = _out.size();
+    _out.insert(_out.end(), _strings.begin(), _strings.end());
+
+    const auto out = std::span<uint8_t>(_out);
+    lua_util::write_bytes(out, static_table::MAGIC, 0);
+    lua_util::write_bytes(out, (uint32_t)0, sizeof(uint32_t));
+    lua_util::write_bytes(out, (uint64_t)strings_offset, sizeof(uint32_t) * 2);
+    lua_util::write_bytes(out, (uint64_t)_strings.size(), sizeof(uint32_t) * 2 + sizeof(uint64_t));
+    lua_util::write_bytes(out, (uint64_t)root, sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2);
+    return std::move(_out);
+  }
+
+private:
+  uint64_t write_table(int idx, int depth) {
+    const void* ptr = lua_topointer(_L, idx);
+    if (const auto it = _tables.find(ptr); it != _tables.end()) return it->second;
+    if (depth >= static_table::MAX_DEPTH) throw std::runtime_error("static_table: table nested too deep");
+    if (!lua_checkstack(_L, 4)) throw std::runtime_error("static_table: lua stack overflow");
+
+    // 1. 收集字符串键, 数组部分之外只允许字符串键
+    idx = lua_absindex(_L, idx);
+    const auto array_count = lua_rawlen(_L, idx);
+    if (array_count > UINT32_MAX) throw std::runtime_error("static_table: array too large");
+    auto keys = std::vector<std::string_view>();
+    lua_pushnil(_L);
+    while (lua_next(_L, idx)) {
+      lua_pop(_L, 1);
+      if (lua_type(_L, -1) == LUA_TSTRING) {
+        size_t size = 0;
+        const char* key = lua_tolstring(_L, -1, &size);
+        keys.emplace_back(key, size);
+        continue;
+      }
+      if (lua_isinteger(_L, -1)) {
+        const auto key = lua_tointeger(_L, -1);
+        if (key >= 1 && (lua_Unsigned)key <= array_count) continue;
+      }
+      throw std::runtime_error("static_table: keys must be strings or array indices");
+    }
+    const auto ph = lua_util::detail::perfect_hash::build(keys);
+    const auto bucket_count = ph.displacements.size();
+
+    // 2. 预留整张表, 子表写在后面
+    _out.resize(align8(_out.size()));
+    const auto offset = _out.size();
+    _out.resize(offset + table_size(array_count, keys.size(), bucket_count));
+    _tables.emplace(ptr, offset);
+
+    auto out = std::span<uint8_t>(_out);
+    lua_util::write_bytes(out, (uint32_t)array_count, offset);
+    lua_util::write_bytes(out, (uint32_t)keys.size(), offset + sizeof(uint32_t));
+    lua_util::write_bytes(out, (uint32_t)bucket_count, offset + sizeof(uint32_t) * 2);
+    lua_util::write_bytes(out, ph.seed, offset + sizeof(uint32_t) * 3);
+    const auto values_offset = offset + STATIC_TABLE_HEADER_SIZE;
+    const auto displacements_offset = values_offset + array_count * STATIC_VALUE_SIZE;
+    const auto entries_offset = displacements_offset + align8(bucket_count * sizeof(uint32_t));
+    lua_util::to_bytes<uint32_t>(ph.displacements, out.subspan(displacements_offset));
+
+    // 3. 写入数组和键值
+    for (size_t i = 0; i < array_count; i++) {
+      lua_rawgeti(_L, idx, (lua_Integer)i + 1);
+      write_value(-1, values_offset + i * STATIC_VALUE_SIZE, depth);
+      lua_pop(_L, 1);
+    }
+    for (size_t k = 0; k < keys.size(); k++) {
+      const auto entry = entries_offset + ph.slots[k] * STATIC_ENTRY_SIZE;
+      const auto key_offset = intern(keys[k]);
+      lua_util::write_bytes(std::span<uint8_t>(_out), key_offset, entry);
+      lua_util::write_bytes(std::span<uint8_t>(_out), (uint32_t)keys[k].size(), entry + sizeof(uint32_t));
+
+      lua_pushlstring(_L, keys[k].data(), keys[k].size());
+      lua_rawget(_L, idx);
+      write_value(-1, entry + sizeof(uint32_t) * 2, depth);
+      lua_pop(_L, 1);
+    }
+    return offset;
+  }
+
+  void write_value(int idx, size_t at, int depth) {
+    switch (lua_type(_L, idx)) {
+    case LUA_TNIL:
+      return put_value(at, static_table::NIL, 0, 0);
+    case LUA_TBOOLEAN:
+      return put_value(at, lua_toboolean(_L, idx) ? static_table::TRUE : static_table::FALSE, 0, 0);
+    case LUA_TNUMBER:
+      if (lua_isinteger(_L, idx)) return put_value(at, static_table::INTEGER, 0, (uint64_t)lua_tointeger(_L, idx));
+      return put_value(at, static_table::FLOAT, 0, std::bit_cast<uint64_t>((double)lua_tonumber(_L, idx)));
+    case LUA_TSTRING: {
+      size_t size = 0;
+      const char* str = lua_tolstring(_L, idx, &size);
+      const auto offset = intern({ str, size });
+      return put_value(at, static_table::STRING, (uint32_t)size, offset);
+    }
+    case LUA_TTABLE: {
+      const auto offset = write_table(idx, depth + 1);
+      return put_value(at, static_table::TABLE, 0, offset);
+    }
+    default:
+      throw std::runtime_error(std::string("static_table: unsupported value ") + luaL_typename(_L, idx));
+    }
+  }
+
+  void put_value(size_t at, static_table::tag tag, uint32_t size, uint64_t payload) {
+    const auto out = std::span<uint8_t>(_out);
+    lua_util::write_bytes(out, (uint32_t)tag, at);
+    lua_util::write_bytes(out, size, at + sizeof(uint32_t));
+    lua_util::write_bytes(out, payload, at + sizeof(uint64_t));
+  }
+
+  uint32_t intern(std::string_view str) {
+    if (const auto it = _string_offsets.find(str); it != _string_offsets.end()) return it->second;
+    if (_strings.size() + str.size() > UINT32_MAX) throw std::runtime_error("static_table: strings too large");
+    const auto offset = (uint32_t)_strings.size();
+    _strings.insert(_strings.end(), str.begin(), str.end());
+    _string_offsets.emplace(str, offset);
+    return offset;
+  }
+
+  lua_State* _L;
+  std::vector<uint8_t> _out;
+  std::vector<uint8_t> _strings;
+  std::unordered_map<const void*, uint64_t> _tables;
+  std::unordered_map<std::string_view, uint32_t> _string_offsets; // views of lua strings alive during build
+};
+
+/// a table userdata, the header fields are read once when it is pushed.
+/// user value 1 is the parent userdata, keeping the root and its owner alive,
+/// user value 2 caches the child userdata by offset
+struct table_ref {
+  std::span<const uint8_t> buffer;
+  std::span<const uint8_t> strings;
+  uint64_t offset;
+  uint32_t array_count;
+  uint32_t key_count;
+  uint32_t bucket_count;
+  uint32_t seed;
+
+  inline size_t values_offset() const { return offset + STATIC_TABLE_HEADER_SIZE; }
+  inline size_t displacements_offset() const { return values_offset() + (size_t)array_count * STATIC_VALUE_SIZE; }
+  inline size_t entries_offset() const {
+    return displacements_offset() + align8((size_t)bucket_count * sizeof(uint32_t));
+  }
+
+  /// read and check the table header at offset
+  bool open(uint64_t table) {
+    if (table > buffer.size() || buffer.size() - table < STATIC_TABLE_HEADER_SIZE || table % 8) return false;
+    offset = table;
+    array_count = lua_util::read_bytes<uint32_t>(buffer, table);
+    key_count = lua_util::read_bytes<uint32_t>(buffer, table + sizeof(uint32_t));
+    bucket_count = lua_util::read_bytes<uint32_t>(buffer, table + sizeof(uint32_t) * 2);
+    seed = lua_util::read_bytes<uint32_t>(buffer, table + sizeof(uint32_t) * 3);
+    if (key_count && !bucket_count) return false;
+    return table_size(array_count, key_count, bucket_count) <= buffer.size() - table;
+  }
+
+  /// find the slot of a string key
+  /// @return the slot, or key_count if not found
+  uint32_t find(std::string_view key) const {
+    if (!key_count) return key_count;
+    const auto hash = lua_util::hash_bytes({ (const uint8_t*)key.data(), key.size() }, seed);
+    const auto bucket = lua_util::detail::perfect_hash::bucket(hash, bucket_count);
+    const auto displacement = lua_util::read_bytes<uint32_t>(buffer, displacements_offset() + bucket * sizeof(uint32_t));
+    const auto slot = lua_util::detail::perfect_hash::slot(hash, displacement, key_count);
+    const auto stored = key_at(slot);
+    return stored.size() == key.size() && (key.empty() || std::memcmp(stored.data(), key.data(), key.size()) == 0) ? slot : key_count;
+  }
+
+  std::string_view key_at(uint32_t slot) const {
+    const auto entry = entries_offset() + (size_t)slot * STATIC_ENTRY_SIZE;
+    return string_at(lua_util::read_bytes<uint32_t>(buffer, entry), lua_util::read_bytes<uint32_t>(buffer, entry + sizeof(uint32_t)));
+  }
+
+  inline size_t value_at(uint32_t slot) const {
+    return entries_offset() + (size_t)slot * STATIC_ENTRY_SIZE + sizeof(uint32_t) * 2;
+  }
+
+  std::string_view string_at(uint64_t str, uint32_t size) const {
+    if (str > strings.size() || size > strings.size() - str) return {}; // 损坏的数据
+    return { (const char*)strings.data() + str, size };
+  }
+};
+
+/// the root userdata, the only one holding the owner
+struct root_ref {
+  table_ref table;
+  std::shared_ptr<const void> owner;
+};
+
+}
+
+constexpr const char* STATIC_CACHE_METATABLE = "lua_util.static_table.cache";
+
+static int static_index(lua_State *L);
+static int static_newindex(lua_State *L);
+static int static_len(lua_State *L);
+static int static_pairs(lua_State *L);
+static int static_next(lua_State *L);
+static int static_gc(lua_State *L);
+
+/// push a new table userdata of size bytes, the table_ref is set by the caller
+static table_ref* new_table(lua_State *L, size_t size) {
+  auto* ud = (table_ref*)lua_newuserdatauv(L, size, 2);
+  if (luaL_newmetatable(L, static_table::METATABLE)) {
+    const luaL_Reg metamethods[] = {
+      { "__index", static_index },
+      { "__newindex", static_newindex },
+      { "__len", static_len },
+      { "__pairs", static_pairs },
+      { "__gc", static_gc },
+    };
+    for (const auto &[name, func] : metamethods) {
+      lua_pushcfunction(L, func);
+      lua_setfield(L, -2, name);
+    }
+    // 隐藏元表, 元方法只会以 static_table 为第一个参数调用
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+  }
+  lua_setmetatable(L, -2);
+  return ud;
+}
+
+/// push the child table at offset table of the parent at idx, cached per parent
+/// so that the same child is the same userdata while it is alive
+static bool push_table(lua_State *L, int idx, const table_ref &parent, uint64_t table) {
+  idx = lua_absindex(L, idx);
+  if (lua_getiuservalue(L, idx, 2) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    if (luaL_newmetatable(L, STATIC_CACHE_METATABLE)) {
+      lua_pushliteral(L, "v");
+      lua_setfield(L, -2, "__mode");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, idx, 2);
+  }
+  const int cache = lua_gettop(L);
+  if (lua_rawgeti(L, cache, (lua_Integer)table) != LUA_TNIL) {
+    lua_remove(L, cache);
+    return true;
+  }
+  lua_pop(L, 1);
+
+  auto ref = table_ref{ parent.buffer, parent.strings, 0, 0, 0, 0, 0 };
+  if (!ref.open(table)) {
+    lua_pop(L, 1);
+    return false;
+  }
+  new (new_table(L, sizeof(table_ref))) table_ref(ref);
+  lua_pushvalue(L, idx);
+  lua_setiuservalue(L, -2, 1);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, cache, (lua_Integer)table);
+  lua_remove(L, cache);
+  return true;
+}
+
+/// push the value at `at` of the table at idx
+static void push_value(lua_State *L, int idx, const table_ref &table, size_t at) {
+  const auto tag = table.buffer[at];
+  const auto size = lua_util::read_bytes<uint32_t>(table.buffer, at + sizeof(uint32_t));
+  const auto payload = lua_util::read_bytes<uint64_t>(table.buffer, at + sizeof(uint64_t));
+  switch (tag) {
+  case static_table::FALSE:
+    lua_pushboolean(L, 0);
+    return;
+  case static_table::TRUE:
+    lua_pushboolean(L, 1);
+    return;
+  case static_table::INTEGER:
+    lua_pushinteger(L, (lua_Integer)payload);
+    return;
+  case static_table::FLOAT:
+    lua_pushnumber(L, (lua_Number)std::bit_cast<double>(payload));
+    return;
+  case static_table::STRING: {
+    const auto str = table.string_at(payload, size);
+    lua_pushlstring(L, str.data(), str.size());
+    return;
+  }
+  case static_table::TABLE:
+    if (push_table(L, idx, table, payload)) return;
+    luaL_error(L, "static_table: corrupted table");
+    return;
+  default:
+    lua_pushnil(L);
+    return;
+  }
+}
+
+static int static_index(lua_State *L) {
+  const auto &table = *(const table_ref*)lua_touserdata(L, 1);
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    size_t size = 0;
+    const char* key = lua_tolstring(L, 2, &size);
+    const auto slot = table.find({ key, size });
+    if (slot == table.key_count) lua_pushnil(L);
+    else push_value(L, 1, table, table.value_at(slot));
+    return 1;
+  }
+  if (lua_isinteger(L, 2)) {
+    const auto key = lua_tointeger(L, 2);
+    if (key >= 1 && (lua_Unsigned)key <= table.array_count) {
+      push_value(L, 1, table, table.values_offset() + (size_t)(key - 1) * STATIC_VALUE_SIZE);
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int static_newindex(lua_State *L) {
+  return luaL_error(L, "static_table is read-only");
+}
+
+static int static_len(lua_State *L) {
+  const auto &table = *(const table_ref*)lua_touserdata(L, 1);
+  lua_pushinteger(L, table.array_count);
+  return 1;
+}
+
+static int static_pairs(lua_State *L) {
+  // 表作为 next 的上值, 直接调用 next 时也不会读到其它值
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, static_next, 1);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+/// upvalue 1: the table
+static int static_next(lua_State *L) {
+  const int self = lua_upvalueindex(1);
+  const auto &table = *(const table_ref*)lua_touserdata(L, self);
+
+  // 位置: 数组元素在前, 之后按槽位顺序
+  size_t pos = 0;
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    size_t size = 0;
+    const char* key = lua_tolstring(L, 2, &size);
+    const auto slot = table.find({ key, size });
+    if (slot == table.key_count) return luaL_error(L, "invalid key to 'next'");
+    pos = (size_t)table.array_count + slot + 1;
+  } else if (lua_isinteger(L, 2)) {
+    const auto key = lua_tointeger(L, 2);
+    if (key < 1 || (lua_Unsigned)key > table.array_count) return luaL_error(L, "invalid key to 'next'");
+    pos = (size_t)key;
+  } else if (!lua_isnil(L, 2)) {
+    return luaL_error(L, "invalid key to 'next'");
+  }
+
+  // 数组中的 nil 跳过
+  for (; pos < table.array_count; pos++) {
+    const auto at = table.values_offset() + pos * STATIC_VALUE_SIZE;
+    if (table.buffer[at] == static_table::NIL) continue;
+    lua_pushinteger(L, (lua_Integer)pos + 1);
+    push_value(L, self, table, at);
+    return 2;
+  }
+  const auto slot = pos - table.array_count;
+  if (slot < table.key_count) {
+    const auto key = table.key_at((uint32_t)slot);
+    lua_pushlstring(L, key.data(), key.size());
+    push_value(L, self, table, table.value_at((uint32_t)slot));
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int static_gc(lua_State *L) {
+  // 只有根表持有 owner, 子表的 table_ref 无需析构
+  if (lua_rawlen(L, 1) == sizeof(root_ref)) ((root_ref*)lua_touserdata(L, 1))->~root_ref();
+  return 0;
+}
+
+std::vector<uint8_t> lua_util::static_table::build(lua_State *L, int idx) {
+  if (!lua_istable(L, idx)) throw std::runtime_error("static_table: not a table");
+  const int top = lua_gettop(L);
+  try {
+    return static_table_builder(L).build(lua_absindex(L, idx));
+  } catch (...) {
+    lua_settop(L, top);
+    throw;
+  }
+}
+
+void lua_util::static_table::push(lua_State *L, std::span<const uint8_t> buffer, std::shared_ptr<const void> owner) {
+  if (buffer.size() < STATIC_HEADER_SIZE || read_bytes<uint32_t>(buffer, 0) != MAGIC)
+    throw std::runtime_error("invalid static table: bad header");
+
+  const auto strings_offset = read_bytes<uint64_t>(buffer, sizeof(uint32_t) * 2);
+  const auto strings_size = read_bytes<uint64_t>(buffer, sizeof(uint32_t) * 2 + sizeof(uint64_t));
+  const auto root = read_bytes<uint64_t>(buffer, sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2);
+  if (strings_offset > buffer.size() || strings_size > buffer.size() - strings_offset)
+    throw std::runtime_error("invalid static table: truncated");
+
+  auto ref = table_ref{ buffer, buffer.subspan(strings_offset, strings_size), 0, 0, 0, 0, 0 };
+  if (!ref.open(root)) throw std::runtime_error("invalid static table: bad root");
+  new (new_table(L, sizeof(root_ref))) root_ref{ ref, std::move(owner) };
+}
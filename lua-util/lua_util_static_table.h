@@ -0,0 +1,63 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <span>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace lua_util {
+
+/// static table
+/// read-only lua tables over a flat buffer, e.g. an archive chunk mapped once and
+/// shared by every state of every process. lookups run in C++ from __index, so no
+/// lua table is built and the gc never walks the data. string keys go through a
+/// minimal perfect hash, array keys 1..n are indexed directly.
+/// only the root userdata holds the owner; a nested table is a userdata cached by
+/// its parent, so t.a == t.a and nested tables work as table keys.
+/// [magic(uint32)] [reserved(uint32)] [strings_offset(uint64)] [strings_size(uint64)] [root(uint64)]
+/// table, 8 aligned:
+///   [array_count(uint32)] [key_count(uint32)] [bucket_count(uint32)] [seed(uint32)]
+///   [value * array_count] [displacement(uint32) * bucket_count, padded to 8]
+///   [key_offset(uint32)] [key_size(uint32)] [value] * key_count, in slot order
+/// value: [tag(uint8)] [pad(uint8) * 3] [size(uint32)] [payload(uint64)]
+///   the payload of a string is its offset in the strings, of a table its offset in the buffer
+class static_table {
+public:
+  /// "STB1" read as little-endian uint32
+  static constexpr uint32_t MAGIC = 0x31425453;
+  static constexpr const char* METATABLE = "lua_util.static_table";
+
+  /// tables nested deeper than this are rejected
+  static constexpr int MAX_DEPTH = 200;
+
+  enum tag : uint8_t {
+    NIL = 0,
+    FALSE = 1,
+    TRUE = 2,
+    INTEGER = 3,
+    FLOAT = 4,
+    STRING = 5,
+    TABLE = 6,
+  };
+
+public:
+  /// build a buffer from a lua table
+  /// keys must be strings or the array indices 1..#t, values booleans, numbers,
+  /// strings or tables. shared tables are stored once, equal strings too
+  /// @param L: the lua state, the stack is left unchanged
+  /// @param idx: the index of the table
+  /// @return the buffer
+  /// @throw std::runtime_error if the table holds an unsupported key or value
+  static std::vector<uint8_t> build(lua_State *L, int idx);
+
+  /// push the root table of a buffer as a read-only userdata
+  /// @param L: the lua state
+  /// @param buffer: the buffer, kept alive by owner
+  /// @param owner: owns the buffer, shared by every state the table is pushed to
+  /// @throw std::runtime_error if the buffer is malformed, nothing is pushed then
+  static void push(lua_State *L, std::span<const uint8_t> buffer, std::shared_ptr<const void> owner);
+};
+
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <lua.hpp>
+
+#include <new>
+#include <tuple>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+#include "lua_util.hpp"
+
+namespace lua_util {
+
+namespace detail {
+
+template<typename F>
+struct method_traits;
+
+template<typename C, typename R, typename... Args>
+struct method_traits<R(C::*)(Args...)> {
+  using result = R;
+  using args = std::tuple<std::decay_t<Args>...>;
+};
+
+template<typename C, typename R, typename... Args>
+struct method_traits<R(C::*)(Args...) const> : method_traits<R(C::*)(Args...)> {};
+
+template<typename C, typename R, typename... Args>
+struct method_traits<R(C::*)(Args...) noexcept> : method_traits<R(C::*)(Args...)> {};
+
+template<typename C, typename R, typename... Args>
+struct method_traits<R(C::*)(Args...) const noexcept> : method_traits<R(C::*)(Args...)> {};
+
+template<typename M>
+struct field_traits;
+
+template<typename C, typename V>
+struct field_traits<V C::*> {
+  using value = V;
+};
+
+}
+
+/// usertype
+/// binds a C++ class as a lua userdata type: constructors, methods, properties
+/// and __gc. the metatable is built once per state and kept in the registry
+/// under the address of TAG, and every userdata starts with that address, so a
+/// type check is one pointer compare instead of luaL_checkudata's registry
+/// lookup by name. methods live in one table per type that is the __index of
+/// the metatable itself, or the first lookup of __index when properties exist.
+/// arguments and results go through arg<>; specialize arg<T> as usertype_arg<T>
+/// to pass objects by value. exceptions thrown by constructors, methods and
+/// conversions are raised as lua errors.
+/// the type name used in errors is the __name of the metatable of each state.
+/// usage:
+///   usertype<vec3>(L, "vec3")
+///     .constructor<float, float, float>()
+///     .method<&vec3::length>("length")
+///     .property<&vec3::x>("x")
+///     .finish();
+///   -- lua: local v = vec3.new(1, 2, 3); v.x = v:length()
+/// @tparam T: the class, at most 8 aligned
+template<typename T>
+class usertype {
+  static_assert(alignof(T) <= 8, "lua userdata is only 8 aligned");
+
+public:
+  /// the per type tag, its address identifies T
+  static inline const char TAG = 0;
+
+  /// begin the registration of T
+  /// @param L: the lua state
+  /// @param name: the global name of the class table, also the __name of the metatable
+  usertype(lua_State *L, std::string_view name) : _L(L), _top(lua_gettop(L)), _global(name) {
+    lua_newtable(L); // metatable
+    lua_newtable(L); // methods
+    lua_newtable(L); // getters
+    lua_newtable(L); // setters
+    lua_newtable(L); // class table
+    lua_pushlstring(L, name.data(), name.size());
+    lua_setfield(L, _top + 1, "__name");
+  }
+
+  ~usertype() { if (_L) lua_settop(_L, _top); }
+
+  usertype(const usertype&) = delete;
+  usertype& operator=(const usertype&) = delete;
+
+  /// add `new(args...)` to the class table
+  template<typename... Args>
+  usertype& constructor() {
+    lua_pushcfunction(_L, &construct<Args...>);
+    lua_setfield(_L, _top + 5, "new");
+    return *this;
+  }
+
+  /// add a method, called as obj:name(args...)
+  /// @tparam F: a member function pointer
+  template<auto F>
+  usertype& method(std::string_view name) {
+    lua_pushcfunction(_L, &call_method<F>);
+    lua_setfield(_L, _top + 2, name.data());
+    return *this;
+  }
+
+  /// add a property, read as obj.name and written as obj.name = v unless const
+  /// @tparam M: a data member pointer
+  template<auto M>
+  usertype& property(std::string_view name) {
+    _properties = true;
+    lua_pushcfunction(_L, &get_field<M>);
+    lua_setfield(_L, _top + 3, name.data());
+    if constexpr (!std::is_const_v<typename detail::field_traits<decltype(M)>::value>) {
+      lua_pushcfunction(_L, &set_field<M>);
+      lua_setfield(_L, _top + 4, name.data());
+    }
+    return *this;
+  }
+
+  /// install the metatable and set the class table as a global
+  void finish() {
+    auto* L = _L;
+    const int mt = _top + 1;
+    if (_properties) {
+      // 方法优先, 其次是属性
+      lua_pushvalue(L, _top + 2);
+      lua_pushvalue(L, _top + 3);
+      lua_pushcclosure(L, &index, 2);
+      lua_setfield(L, mt, "__index");
+      lua_pushvalue(L, _top + 4);
+      lua_pushcclosure(L, &newindex, 1);
+      lua_setfield(L, mt, "__newindex");
+    } else {
+      // 没有属性时方法表直接作为 __index, 查找不经过 C 函数
+      lua_pushvalue(L, _top + 2);
+      lua_setfield(L, mt, "__index");
+    }
+    lua_pushcfunction(L, &gc);
+    lua_setfield(L, mt, "__gc");
+
+    lua_pushvalue(L, mt);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &TAG);
+    lua_pushvalue(L, _top + 5);
+    lua_setglobal(L, _global.c_str());
+    lua_settop(L, _top);
+    _L = nullptr;
+  }
+
+public:
+  /// push a copy of value, owned and destroyed by lua
+  /// @throw std::runtime_error if T is not registered in L
+  static void push(lua_State *L, T value) {
+    auto* b = new_box(L, sizeof(owned_box));
+    auto* ob = (owned_box*)b;
+    b->ptr = new (ob->storage) T(std::move(value));
+    b->owned = true;
+  }
+
+  /// push a reference to value, which must outlive every use in lua
+  /// @throw std::runtime_error if T is not registered in L
+  static void push(lua_State *L, T *value) {
+    auto* b = new_box(L, sizeof(box));
+    b->ptr = value;
+  }
+
+  /// get the object at idx
+  /// @return the object, or nullptr if the value is not a T
+  static T* test(lua_State *L, int idx) {
+    if (lua_type(L, idx) != LUA_TUSERDATA || lua_rawlen(L, idx) < sizeof(box)) return nullptr;
+    auto* b = (box*)lua_touserdata(L, idx);
+    return b->tag == &TAG ? b->ptr : nullptr;
+  }
+
+  /// get the object at idx
+  /// @return the object, raises a lua error if the value is not a T
+  static T* check(lua_State *L, int idx) {
+    auto* ptr = test(L, idx);
+    if (!ptr) luaL_error(L, "arg #%d must be a %s", idx, push_name(L));
+    return ptr;
+  }
+
+private:
+  struct box {
+    const void* tag;
+    T* ptr;
+    bool owned;
+  };
+
+  struct owned_box {
+    box head;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  /// push the __name of the metatable of T in L
+  /// @return the name, valid while it is on the stack
+  static const char* push_name(lua_State *L) {
+    const char* name = nullptr;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &TAG) == LUA_TTABLE && lua_getfield(L, -1, "__name") == LUA_TSTRING)
+      name = lua_tostring(L, -1);
+    return name ? name : "usertype";
+  }
+
+  /// run func, a C++ exception becomes a lua error raised after the locals of func are gone
+  /// @return the result count of func
+  template<typename F>
+  static int protect(lua_State *L, F &&func) {
+    // lua 按 C 编译时 lua_error 使用 longjmp, 不能在 catch 块内调用
+    char error[256];
+    try {
+      return func();
+    } catch (const std::exception &e) {
+      std::snprintf(error, sizeof(error), "%s", e.what());
+    }
+    lua_pushstring(L, error);
+    return lua_error(L);
+  }
+
+  /// push a userdata with the metatable of T, ptr is set by the caller
+  static box* new_box(lua_State *L, size_t size) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &TAG) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      throw std::runtime_error("usertype is not registered");
+    }
+    auto* b = (box*)lua_newuserdata(L, size);
+    b->tag = &TAG;
+    b->ptr = nullptr;
+    b->owned = false;
+    lua_insert(L, -2);
+    lua_setmetatable(L, -2);
+    return b;
+  }
+
+  template<typename... Args>
+  static int construct(lua_State *L) {
+    if (lua_gettop(L) != (int)sizeof...(Args))
+      return luaL_error(L, "wrong number of arguments: expected %d, got %d", (int)sizeof...(Args), lua_gettop(L));
+    return protect(L, [L] {
+      std::tuple<std::decay_t<Args>...> args;
+      lua_util_extract_args(L, args, std::index_sequence_for<Args...>{});
+
+      // 构造成功后才设置 ptr, 构造失败时 __gc 不会析构
+      auto* b = new_box(L, sizeof(owned_box));
+      auto* ob = (owned_box*)b;
+      b->ptr = std::apply([ob](auto&&... a) { return new (ob->storage) T(std::move(a)...); }, args);
+      b->owned = true;
+      return 1;
+    });
+  }
+
+  template<auto F>
+  static int call_method(lua_State *L) {
+    using traits = detail::method_traits<decltype(F)>;
+    using R = typename traits::result;
+    constexpr int count = (int)std::tuple_size_v<typename traits::args>;
+    if (lua_gettop(L) != count + 1)
+      return luaL_error(L, "wrong number of arguments: expected %d, got %d", count, lua_gettop(L) - 1);
+
+    T* self = check(L, 1);
+    return protect(L, [L, self] {
+      typename traits::args args;
+      lua_util_extract_args(L, args, std::make_index_sequence<count>{}, 2);
+
+      if constexpr (std::is_void_v<R>) {
+        std::apply([self](auto&... a) { (self->*F)(a...); }, args);
+        return 0;
+      } else {
+        arg<std::decay_t<R>>::push(L, std::apply([self](auto&... a) -> R { return (self->*F)(a...); }, args));
+        return 1;
+      }
+    });
+  }
+
+  template<auto M>
+  static int get_field(lua_State *L) {
+    using V = std::remove_const_t<typename detail::field_traits<decltype(M)>::value>;
+    T* self = check(L, 1);
+    return protect(L, [L, self] {
+      arg<V>::push(L, self->*M);
+      return 1;
+    });
+  }
+
+  /// called by newindex as setter(self, value)
+  template<auto M>
+  static int set_field(lua_State *L) {
+    using V = typename detail::field_traits<decltype(M)>::value;
+    T* self = check(L, 1);
+    return protect(L, [L, self] {
+      self->*M = (V)arg<V>::get(L, 2);
+      return 0;
+    });
+  }
+
+  /// upvalue 1: methods, upvalue 2: getters
+  static int index(lua_State *L) {
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL) return 1;
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNIL) return 1;
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    return 1;
+  }
+
+  /// upvalue 1: setters
+  static int newindex(lua_State *L) {
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL)
+      return luaL_error(L, "%s has no writable field '%s'", push_name(L), luaL_tolstring(L, 2, nullptr));
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 3);
+    lua_call(L, 2, 0);
+    return 0;
+  }
+
+  static int gc(lua_State *L) {
+    auto* b = (box*)lua_touserdata(L, 1);
+    if (b && b->owned && b->ptr) b->ptr->~T();
+    return 0;
+  }
+
+  lua_State* _L;
+  int _top;
+  std::string _global;
+  bool _properties = false;
+};
+
+/// arg<> support for a registered usertype, objects are passed by value
+/// template<> struct arg<vec3> : usertype_arg<vec3> {};
+template<typename T>
+struct usertype_arg {
+  static T get(lua_State* L, int idx) { return *usertype<T>::check(L, idx); }
+
+  static inline void push(lua_State* L, const T& value) { usertype<T>::push(L, T(value)); }
+};
+
+}
@@ -0,0 +1,89 @@
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <lua_util_chunk.h>
+
+// 按字节移位的旧实现, 作为对比基线
+template<typename T>
+static void scalar_to_bytes(const std::vector<T>& values, std::vector<uint8_t>& out) {
+  out.clear();
+  for (const auto value : values)
+    for (size_t i = 0; i < sizeof(T); i++)
+      out.push_back((value >> (i * 8)) & 0xff);
+}
+
+template<typename T>
+static void scalar_from_bytes(const std::vector<uint8_t>& data, std::vector<T>& out) {
+  out.clear();
+  for (size_t i = 0; i + sizeof(T) <= data.size(); i += sizeof(T)) {
+    T value = 0;
+    for (size_t j = 0; j < sizeof(T); j++) value |= (T)data[i + j] << (j * 8);
+    out.push_back(value);
+  }
+}
+
+template<typename F>
+static double bench(const char* name, size_t bytes, int rounds, F&& func) {
+  func(); // warm up
+  const auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) func();
+  const auto end = std::chrono::steady_clock::now();
+
+  const double seconds = std::chrono::duration<double>(end - begin).count();
+  const double mbps = (double)bytes * rounds / seconds / (1024.0 * 1024.0);
+  std::cout << "  " << name << ": " << mbps << " MB/s" << std::endl;
+  return mbps;
+}
+
+template<typename T>
+static void bench_type(const char* type_name, size_t mb, int rounds) {
+  const size_t count = mb * 1024 * 1024 / sizeof(T);
+  const size_t bytes = count * sizeof(T);
+
+  auto values = std::vector<T>(count);
+  for (size_t i = 0; i < count; i++) values[i] = (T)(i * 0x9E3779B97F4A7C15ull);
+
+  auto buffer = std::vector<uint8_t>(bytes);
+  auto decoded = std::vector<T>(count);
+  auto scratch_bytes = std::vector<uint8_t>();
+  auto scratch_values = std::vector<T>();
+
+  std::cout << type_name << " x " << count << " (" << mb << " MB)" << std::endl;
+  bench("memcpy            ", bytes, rounds, [&] {
+    std::memcpy(buffer.data(), values.data(), bytes);
+  });
+  bench("scalar to_bytes   ", bytes, rounds, [&] { scalar_to_bytes(values, scratch_bytes); });
+  bench("scalar from_bytes ", bytes, rounds, [&] { scalar_from_bytes(buffer, scratch_values); });
+  bench("to_bytes (span)   ", bytes, rounds, [&] {
+    lua_util::to_bytes<T>(values, buffer);
+  });
+  bench("from_bytes (span) ", bytes, rounds, [&] {
+    lua_util::from_bytes<T>(buffer, decoded);
+  });
+  bench("to_bytes (vector) ", bytes, rounds, [&] {
+    auto r = lua_util::to_bytes(values.data(), count);
+    if (r.size() != bytes) std::abort();
+  });
+  bench("from_bytes (vector)", bytes, rounds, [&] {
+    auto r = lua_util::from_bytes<T>(buffer.data(), bytes);
+    if (r.size() != count) std::abort();
+  });
+
+  if (decoded != values) {
+    std::cerr << "round trip mismatch for " << type_name << std::endl;
+    std::exit(-1);
+  }
+}
+
+int main(int argc, char** argv) {
+  const size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  const int rounds = argc > 2 ? std::atoi(argv[2]) : 8;
+
+  bench_type<uint16_t>("uint16", mb, rounds);
+  bench_type<uint32_t>("uint32", mb, rounds);
+  bench_type<uint64_t>("uint64", mb, rounds);
+  return 0;
+}
@@ -1,9 +1,43 @@
 
 #include <array>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <filesystem>
 
 #include <lua_util.hpp>
+#include <lua_util_array.h>
+#include <lua_util_bytes.h>
+#include <lua_util_chunk.h>
+#include <lua_util_codec.h>
+#include <lua_util_actor.hpp>
+#include <lua_util_usertype.hpp>
+#include <lua_util_static_table.h>
+
+#include <test_pack.h> // lua_embed
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  std::cout << (ok ? "[ok] " : "[FAIL] ") << what << std::endl;
+  if (!ok) failures++;
+}
+
+template<typename F>
+void check_throws(F &&func, const char* what) {
+  auto thrown = false;
+  try {
+    func();
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  check(thrown, what);
+}
 
 int print(lua_State* L) {
   using namespace lua_util;
@@ -62,6 +96,583 @@ std::string Ext_Str_FuncC(const double& param1, const std::string& param2, const
   return r;
 }
 
+/// run a lua chunk returning a boolean, false on errors
+bool eval(lua_State* L, const char* code) {
+  if (luaL_loadstring(L, code) || lua_pcall(L, 0, 1, 0)) {
+    std::cout << "lua error: " << lua_tostring(L, -1) << std::endl;
+    lua_pop(L, 1);
+    return false;
+  }
+  const auto ok = lua_toboolean(L, -1) != 0;
+  lua_pop(L, 1);
+  return ok;
+}
+
+bool same(std::span<const uint8_t> data, const std::vector<uint8_t> &expected) {
+  return std::equal(data.begin(), data.end(), expected.begin(), expected.end());
+}
+
+void test_byte_io() {
+  using namespace lua_util;
+  std::cout << ">> byte io:" << std::endl;
+
+  // 非零偏移处写入再读回, 字节序固定为小端
+  auto buffer = std::vector<uint8_t>(16, 0xee);
+  write_bytes<uint32_t>(std::span<uint8_t>(buffer), 0x04030201u, 3);
+  write_bytes<uint64_t>(std::span<uint8_t>(buffer), 0x0807060504030201ull, 7);
+  check(buffer[2] == 0xee && buffer[3] == 1 && buffer[6] == 4 && buffer[15] == 0xee, "write_bytes at an offset");
+  check(read_bytes<uint32_t>(buffer, 3) == 0x04030201u && read_bytes<uint64_t>(buffer, 7) == 0x0807060504030201ull,
+    "read_bytes at an offset");
+}
+
+/// build an archive in memory, the chunk owns a copy of the buffer
+lua_util::chunk build(std::unordered_map<uint64_t, std::span<uint8_t>> chunks,
+                      const lua_util::chunk::build_options &options = {}) {
+  const auto buffer = lua_util::chunk::build_chunk_buffer(chunks, options);
+  auto* copy = new uint8_t[buffer.size()];
+  std::copy(buffer.begin(), buffer.end(), copy);
+  return lua_util::chunk(copy, buffer.size());
+}
+
+/// build an archive of lua sources in memory, ids follow the order of modules
+lua_util::chunk build_modules(std::vector<std::pair<std::string, std::string>> modules,
+                              lua_util::chunk::build_options options = {}) {
+  auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>();
+  for (size_t i = 0; i < modules.size(); i++) {
+    auto &[name, source] = modules[i];
+    chunks[i + 1] = { (uint8_t*)source.data(), source.size() };
+    options.module_paths[name] = i + 1;
+  }
+  return build(chunks, options);
+}
+
+void test_archive(const std::filesystem::path &dir) {
+  using namespace lua_util;
+  std::cout << ">> chunk archive:" << std::endl;
+
+  auto a = std::vector<uint8_t>{ 1, 2, 3 };
+  auto b = std::vector<uint8_t>(1000, 7);
+  auto c = std::vector<uint8_t>{ 9, 9 };
+  const auto path = (dir / "lua-util-test.luachunk").string();
+
+  // round trip through a file, with checksums
+  {
+    auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>{ { 1, a }, { 2, b } };
+    auto options = chunk::build_options();
+    options.checksum = true;
+    const auto buffer = chunk::build_chunk_buffer(chunks, options);
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write((const char*)buffer.data(), buffer.size());
+
+    const auto archive = chunk(path);
+    check(archive.size() == 2 && archive.checksummed(), "archive holds 2 checksummed chunks");
+    check(same(archive.get(1), a) && same(archive.get(2), b), "archive round trip");
+    check(archive.get(3).empty(), "missing chunk is empty");
+  }
+
+  // append replaces a chunk and adds one, compact drops the old bytes
+  {
+    auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>{ { 1, c }, { 3, a } };
+    chunk::append_chunk_file(path, chunks);
+    const auto appended = chunk(path);
+    check(appended.size() == 3 && same(appended.get(1), c) && same(appended.get(3), a), "append");
+    check(appended.dead_size() > 0, "append leaves dead bytes");
+  }
+  chunk::compact_chunk_file(path);
+  {
+    const auto compacted = chunk(path);
+    check(compacted.size() == 3 && compacted.dead_size() == 0 && same(compacted.get(2), b), "compact");
+  }
+
+  // an append cut off before its trailer falls back to the previous header
+  {
+    auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>{ { 4, b } };
+    chunk::append_chunk_file(path, chunks);
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 5);
+    const auto recovered = chunk(path);
+    check(recovered.size() == 3 && !recovered.contains(4) && same(recovered.get(1), c), "truncated append");
+  }
+  std::filesystem::resize_file(path, 10);
+  check_throws([&] { const auto broken = chunk(path); }, "a 10 byte archive is rejected");
+  std::filesystem::remove(path);
+}
+
+void test_chunk_stack() {
+  using namespace lua_util;
+  std::cout << ">> chunk stack:" << std::endl;
+
+  auto a = std::vector<uint8_t>{ 1, 2, 3 };
+  auto b = std::vector<uint8_t>{ 4, 5 };
+  auto c = std::vector<uint8_t>{ 6 };
+  auto stack = chunk_stack(build({ { 1, a }, { 2, b } }));
+  stack.push(build({ { 2, c }, { 3, a } }));
+
+  check(stack.layer_count() == 2 && stack.size() == 3, "stack of 2 layers holds 3 chunks");
+  check(same(stack.get(1), a) && same(stack.get(2), c) && same(stack.get(3), a), "patch layer shadows the base");
+  check(same(stack.layer(0).get(2), b), "shadowed chunk stays in the base layer");
+  check(stack.get(4).empty() && !stack.contains(4), "missing chunk is empty");
+}
+
+void test_hot_order() {
+  using namespace lua_util;
+  std::cout << ">> hot order:" << std::endl;
+
+  const auto modules = std::vector<std::pair<std::string, std::string>>{
+    { "a", "return 'a'" }, { "b", "return 'b'" }, { "c", "return 'c'" } };
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(build_modules(modules)));
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+
+  requirer.start_recording();
+  eval(L, "require('c') require('a') require('c') return true");
+  const auto records = requirer.stop_recording();
+  lua_close(L);
+
+  const auto order = lua_custom_requirer::load_order(records);
+  const auto names = lua_custom_requirer::load_order_names(records);
+  check(order == std::vector<uint64_t>{ 3, 1 }, "load order lists first touches by chunk id");
+  check(names == std::vector<std::string>{ "c", "a" }, "load order lists first touches by name");
+
+  // 记录的顺序排在 archive 开头, hot_size 覆盖它们
+  auto options = chunk::build_options();
+  options.hot_order = order;
+  const auto archive = build_modules(modules, options);
+  const auto raw = archive.get_raw();
+  const auto c = archive.get(3), a = archive.get(1), b = archive.get(2);
+  check(c.data() < a.data() && a.data() < b.data(), "hot chunks are laid out first");
+  check(archive.hot_size() == (size_t)(a.data() + a.size() - raw.data()), "hot_size ends after the last hot chunk");
+}
+
+void test_deduplicate() {
+  using namespace lua_util;
+  std::cout << ">> deduplicate:" << std::endl;
+
+  auto a = std::vector<uint8_t>(64, 1);
+  auto copy = a;
+  auto b = std::vector<uint8_t>(64, 2);
+  const auto archive = build({ { 1, a }, { 2, copy }, { 3, b } });
+  check(archive.get(1).data() == archive.get(2).data() && same(archive.get(2), a), "identical payloads share one offset");
+  check(archive.get(3).data() != archive.get(1).data(), "distinct payloads are stored apart");
+
+  auto options = chunk::build_options();
+  options.deduplicate = false;
+  const auto plain = build({ { 1, a }, { 2, copy } }, options);
+  check(plain.get(1).data() != plain.get(2).data(), "deduplicate = false stores each payload");
+}
+
+void test_checksum() {
+  using namespace lua_util;
+  std::cout << ">> checksum:" << std::endl;
+
+  auto a = std::vector<uint8_t>(32, 1);
+  auto b = std::vector<uint8_t>(32, 2);
+  auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>{ { 1, a }, { 2, b } };
+  auto options = chunk::build_options();
+  options.checksum = true;
+  auto buffer = chunk::build_chunk_buffer(chunks, options);
+  const auto offset = chunk::borrow(buffer).get(1).data() - buffer.data();
+
+  buffer[offset + 5] ^= 0xff;
+  const auto archive = chunk::borrow(buffer);
+  check(archive.get(1).empty() && archive.contains(1), "a corrupted chunk reads as empty");
+  check(archive.get(1).empty(), "a corrupted chunk stays empty");
+  check(same(archive.get(2), b), "other chunks still verify");
+}
+
+/// root: 20 -> 200, 10 -> 100 { 12, 11 -> 110 }, 5
+void fill_tree(lua_util::id_tree &root) {
+  root.push(20, 200);
+  auto &node = root.get_child(root.push(10, 100));
+  node.push(12);
+  node.push(11, 110);
+  root.push(5);
+}
+
+void test_frozen_tree() {
+  using namespace lua_util;
+  std::cout << ">> frozen id tree:" << std::endl;
+
+  auto tree = id_tree();
+  fill_tree(tree);
+  const auto frozen = frozen_id_tree(tree);
+  const auto node = frozen.find(std::vector<size_t>{ 10 });
+  const auto leaf = frozen.find(std::vector<size_t>{ 10, 11 });
+  check(frozen.size() == 6 && frozen.child_count(frozen_id_tree::ROOT) == 3, "frozen tree keeps every node");
+  check(node != frozen_id_tree::NULL_IDX && frozen.data(node) == 100 && frozen.child_count(node) == 2, "frozen tree finds a node");
+  check(leaf != frozen_id_tree::NULL_IDX && frozen.data(leaf) == 110 && frozen.child_count(leaf) == 0, "frozen tree finds a leaf");
+  check(frozen.id(frozen.child(node, 0)) == 11 && frozen.id(frozen.child(node, 1)) == 12, "frozen children are sorted by id");
+  check(frozen.find(std::vector<size_t>{ 10, 13 }) == frozen_id_tree::NULL_IDX &&
+    frozen.find(std::vector<size_t>{ 7 }) == frozen_id_tree::NULL_IDX, "frozen tree misses absent ids");
+}
+
+void test_tree_view() {
+  using namespace lua_util;
+  std::cout << ">> id tree view:" << std::endl;
+
+  auto tree = id_tree();
+  fill_tree(tree);
+  auto buffer = std::vector<uint8_t>();
+  id_tree_view::serialize(tree, buffer);
+  const auto view = id_tree_view(buffer);
+  const auto node = view.find(std::vector<size_t>{ 10 });
+  const auto leaf = view.find(std::vector<size_t>{ 10, 11 });
+  check(view.size() == 6 && view.child_count(id_tree_view::ROOT) == 3, "view reads every node");
+  check(node != id_tree_view::NULL_IDX && view.data(node) == 100 && view.child_count(node) == 2, "view finds a node");
+  check(leaf != id_tree_view::NULL_IDX && view.data(leaf) == 110 && view.child_count(leaf) == 0, "view finds a leaf");
+  check(view.find(std::vector<size_t>{ 20, 1 }) == id_tree_view::NULL_IDX, "view misses absent ids");
+
+  buffer.resize(buffer.size() - 1);
+  check_throws([&] { (void)id_tree_view(buffer); }, "a truncated view is rejected");
+}
+
+void test_resolve_cache() {
+  using namespace lua_util;
+  std::cout << ">> resolve cache:" << std::endl;
+
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(build_modules({ { "a", "return 'a'" } })));
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+
+  check(eval(L, "return require('a') == 'a'"), "first require resolves");
+  check(eval(L, "package.loaded.a = nil return require('a') == 'a'"), "second require hits the cache");
+  check(eval(L, "return not pcall(require, 'b') and not pcall(require, 'b')"), "a miss stays a miss");
+
+  // 替换 chunk 后缓存失效, 命中和未命中都重新解析
+  requirer.set_lua_src_chunk(chunk_stack(build_modules({ { "a", "return 'new a'" }, { "b", "return 'b'" } })));
+  check(eval(L, "package.loaded.a = nil return require('a') == 'new a'"), "a new archive drops cached hits");
+  check(eval(L, "return require('b') == 'b'"), "a new archive drops cached misses");
+  lua_close(L);
+}
+
+void test_module_index() {
+  using namespace lua_util;
+  std::cout << ">> module index:" << std::endl;
+
+  auto modules = std::unordered_map<std::string, uint64_t>();
+  for (uint64_t i = 0; i < 100; i++) modules["game/module" + std::to_string(i)] = i + 1;
+  const auto buffer = module_index::build(modules);
+  const auto index = module_index(buffer);
+
+  auto found = index.size() == modules.size();
+  for (const auto &[name, id] : modules) found = found && index.find(name) == id;
+  check(found, "module index finds every module");
+  check(index.find("game/module100") == module_index::NULL_ID && index.find("") == module_index::NULL_ID &&
+    index.find("game") == module_index::NULL_ID, "module index misses absent names");
+
+  auto visited = size_t(0);
+  index.for_each([&](std::string_view path, uint64_t id) { visited += modules.at(std::string(path)) == id; });
+  check(visited == modules.size(), "module index enumerates every module");
+}
+
+void test_require_stats() {
+  using namespace lua_util;
+  std::cout << ">> require stats:" << std::endl;
+
+  const auto a = std::string("return 'a'"), b = std::string("return 'bb'");
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(build_modules({ { "a", a }, { "b", b } })));
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+  eval(L, "require('a') require('b') package.loaded.a = nil require('a') return pcall(require, 'c')");
+
+  const auto &stats = requirer.get_stats();
+  check(stats.hits == 3 && stats.misses == 1, "stats count hits and misses");
+  check(stats.bytes == a.size() * 2 + b.size(), "stats count loaded bytes");
+
+  auto loads = std::unordered_map<std::string, uint64_t>();
+  requirer.for_each_module_stats([&](std::string_view name, const lua_custom_requirer::module_stats &module) {
+    loads[std::string(name)] = module.loads;
+  });
+  check(loads.size() == 2 && loads["a"] == 2 && loads["b"] == 1, "stats count loads per module");
+
+  requirer.reset_stats();
+  auto modules = size_t(0);
+  requirer.for_each_module_stats([&](std::string_view, const lua_custom_requirer::module_stats &) { modules++; });
+  check(requirer.get_stats().hits == 0 && requirer.get_stats().bytes == 0 && modules == 0, "reset_stats clears the counters");
+  lua_close(L);
+}
+
+void test_module_archive() {
+  using namespace lua_util;
+  std::cout << ">> module archive:" << std::endl;
+
+  const auto archive = std::make_shared<const module_archive>(
+    chunk_stack(build_modules({ { "shared", "counter = (counter or 0) + 1 return { state = counter }" } })),
+    id_tree(), path_part_collection());
+  check(archive->find("shared") == 1 && archive->find("other") == id_tree::NULL_DATA, "module archive finds modules");
+
+  // 两个状态机共用一份 archive, 各自加载自己的模块实例
+  lua_State* states[] = { luaL_newstate(), luaL_newstate() };
+  auto loaded = true;
+  for (auto* L : states) {
+    luaL_openlibs(L);
+    module_archive::register_searcher(L, archive);
+    loaded = eval(L, "return require('shared').state == 1 and not pcall(require, 'other')") && loaded;
+  }
+  check(loaded, "one archive is required from two states");
+  check(archive.use_count() == 3, "each state holds the archive");
+  for (auto* L : states) lua_close(L);
+  check(archive.use_count() == 1, "closing the states releases the archive");
+}
+
+void test_lua_pack() {
+  using namespace lua_util;
+  std::cout << ">> lua-pack:" << std::endl;
+
+  // lua-util-test-pack 打包的 test 目录
+  const auto archive = module_archive(chunk_stack(chunk(LUA_UTIL_TEST_PACK)));
+  const auto code = archive.chunks().get(archive.find("main"));
+  check(code.size() > 4 && std::memcmp(code.data(), LUA_SIGNATURE, 4) == 0, "lua-pack stores bytecode");
+
+  auto* L = luaL_newstate();
+  lua_Debug ar;
+  const auto loaded = luaL_loadbuffer(L, (const char*)code.data(), code.size(), "main") == LUA_OK;
+  check(loaded, "packed bytecode loads");
+  check(loaded && lua_getinfo(L, ">S", &ar) && std::strcmp(ar.source, "=?") == 0, "packed bytecode is stripped");
+  lua_close(L);
+
+  // lua-util-test-pack-parallel 用 4 个线程从同一缓存打包, 结果应逐字节相同
+  const auto parallel = chunk(LUA_UTIL_TEST_PACK_PARALLEL);
+  const auto serial = archive.chunks().layer(0).get_raw();
+  const auto raw = parallel.get_raw();
+  check(std::equal(raw.begin(), raw.end(), serial.begin(), serial.end()), "parallel cached packing gives the same archive");
+}
+
+void test_lua_embed() {
+  using namespace lua_util;
+  std::cout << ">> lua_embed:" << std::endl;
+
+  // 编译期即可在内嵌索引中查找
+  static_assert(chunk::find_entry(lua_embedded::test_pack_entries, chunk::TREE_ID)->id == chunk::TREE_ID);
+
+  const auto file = chunk(LUA_UTIL_TEST_PACK);
+  const auto archive = module_archive(chunk_stack(lua_embedded::test_pack()));
+  const auto id = archive.find("main");
+  const auto embedded = archive.chunks().get(id);
+  const auto code = file.get(id);
+  check(!embedded.empty() && std::equal(embedded.begin(), embedded.end(), code.begin(), code.end()),
+    "embedded archive matches the packed file");
+  check(archive.chunks().layer(0).get_raw().data() == lua_embedded::test_pack_data, "embedded archive is borrowed, not copied");
+}
+
+void test_lazy_require() {
+  using namespace lua_util;
+  std::cout << ">> lazy_require:" << std::endl;
+
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(build_modules({
+    { "lazy", "loads = (loads or 0) + 1 return { value = 42, twice = function(x) return x * 2 end }" } })));
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+  requirer.register_lazy_require(L);
+
+  check(eval(L, "lazy = lazy_require('lazy') return loads == nil and package.loaded.lazy == nil"),
+    "lazy_require defers the load");
+  check(eval(L, "return lazy.value == 42 and loads == 1"), "the first field access loads the module");
+  check(eval(L, "return lazy.twice(4) == 8 and loads == 1"), "later accesses do not load again");
+  check(eval(L, "return rawequal(lazy_require('lazy'), package.loaded.lazy)"), "a loaded module is returned at once");
+  check(eval(L, "return not pcall(lazy_require, 'missing')"), "a module not in the archive fails at once");
+  lua_close(L);
+}
+
+void test_reload(const std::filesystem::path &dir) {
+  using namespace lua_util;
+  std::cout << ">> reload:" << std::endl;
+
+  const auto path = (dir / "lua-util-reload.luachunk").string();
+  const auto write = [&](std::vector<std::pair<std::string, std::string>> modules) {
+    auto chunks = std::unordered_map<uint64_t, std::span<uint8_t>>();
+    auto options = chunk::build_options();
+    for (size_t i = 0; i < modules.size(); i++) {
+      chunks[i + 1] = { (uint8_t*)modules[i].second.data(), modules[i].second.size() };
+      options.module_paths[modules[i].first] = i + 1;
+    }
+    // 映射中的文件不能原地改写, 写到新文件再替换
+    const auto buffer = chunk::build_chunk_buffer(chunks, options);
+    std::ofstream(path + ".tmp", std::ios::binary | std::ios::trunc).write((const char*)buffer.data(), buffer.size());
+    std::filesystem::rename(path + ".tmp", path);
+  };
+  write({ { "a", "return 'a'" }, { "b", "return 'b'" } });
+
+  // 补丁层覆盖 b, 对应 chunk id 2
+  auto patch = std::string("return 'patched b'");
+  auto layers = std::vector<chunk>();
+  layers.push_back(chunk(path));
+  layers.push_back(build({ { 2, { (uint8_t*)patch.data(), patch.size() } } }));
+
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(std::move(layers)));
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+  check(eval(L, "return require('a') == 'a' and require('b') == 'patched b'"), "patch layer is required");
+
+  write({ { "a", "return 'new a'" }, { "b", "return 'new b'" } });
+  const auto result = requirer.reload(L, path, true);
+  check(result.changed == std::vector<std::string>{ "a" } && result.failed.empty(), "reload reports the changed module");
+  check(requirer.lua_src_chunk().layer_count() == 2, "reload from a file keeps the patch layer");
+  check(eval(L, "return package.loaded.a == 'new a' and require('b') == 'patched b'"), "changed module is required again");
+  lua_close(L);
+  std::filesystem::remove(path);
+}
+
+void test_enumerate() {
+  using namespace lua_util;
+  std::cout << ">> enumerate and preload:" << std::endl;
+
+  auto tree = id_tree();
+  fill_tree(tree);
+  auto ids = std::vector<size_t>();
+  tree.for_each_child([&](const id_tree &node) { ids.push_back(node.id()); });
+  std::sort(ids.begin(), ids.end());
+  check(ids == std::vector<size_t>{ 0, 5, 10, 11, 12, 20 }, "for_each_child visits every node once");
+
+  auto paths = std::vector<std::vector<size_t>>();
+  tree.for_each_descendant([&](std::span<const size_t> path, const id_tree &) { paths.emplace_back(path.begin(), path.end()); });
+  check(paths.size() == 5 && std::count(paths.begin(), paths.end(), std::vector<size_t>{ 10, 11 }) == 1,
+    "for_each_descendant passes the path of each node");
+
+  const auto modules = std::vector<std::pair<std::string, std::string>>{
+    { "game/ai/brain", "return 'brain'" }, { "game/ai/eyes", "return 'eyes'" },
+    { "game/ui", "return 'ui'" }, { "main", "return 'main'" } };
+  auto requirer = lua_custom_requirer();
+  requirer.set_lua_src_chunk(chunk_stack(build_modules(modules)));
+  const auto ai = requirer.enumerate("game/ai");
+  check(ai.size() == 2 && ai[0] == std::pair<std::string, uint64_t>{ "game/ai/brain", 1 } && ai[1].first == "game/ai/eyes",
+    "enumerate lists the modules under a prefix");
+  check(requirer.enumerate("").size() == 4 && requirer.enumerate("game/a").empty(), "enumerate matches whole path parts");
+
+  auto* L = luaL_newstate();
+  luaL_openlibs(L);
+  requirer.register_requirer(L);
+  check(requirer.preload(L, "game") == 3 && requirer.preload(L, "game") == 0, "preload loads a subtree once");
+  check(eval(L, "return package.preload['game/ui'] ~= nil and package.preload.main == nil and require('game/ai/eyes') == 'eyes'"),
+    "preloaded modules are required from package.preload");
+
+  // reload 移除的预加载模块也从 package.preload 中删除
+  requirer.reload(L, chunk_stack(build_modules({ modules[0], modules[1], modules[3] })));
+  check(eval(L, "return package.preload['game/ui'] == nil and package.preload['game/ai/brain'] ~= nil"),
+    "reload drops removed modules from package.preload");
+  lua_close(L);
+}
+
+void test_codec(lua_util::lua_env &env) {
+  using namespace lua_util;
+  std::cout << ">> value codec:" << std::endl;
+  auto* L = env.env();
+
+  eval(L, "codec_src = { 1, 2.5, 'text', true, nested = { key = 'repeated value' }, again = 'repeated value' } "
+    "codec_src.self = codec_src return true");
+  lua_getglobal(L, "codec_src");
+  const auto encoded = value_codec::encode(L, -1);
+  lua_pop(L, 1);
+  value_codec::decode(L, encoded);
+  lua_setglobal(L, "codec_dst");
+  check(eval(L, "return codec_dst[1] == 1 and codec_dst[2] == 2.5 and codec_dst[3] == 'text' and codec_dst[4] "
+    "and codec_dst.nested.key == codec_dst.again and codec_dst.self == codec_dst"), "codec round trip");
+
+  const auto truncated = std::vector<uint8_t>(encoded.begin(), encoded.begin() + encoded.size() / 2);
+  const auto top = lua_gettop(L);
+  check_throws([&] { value_codec::decode(L, truncated); }, "truncated encoding is rejected");
+  check(lua_gettop(L) == top, "rejected decode pushes nothing");
+}
+
+void test_copy_from(lua_util::lua_env &src) {
+  std::cout << ">> copy_from:" << std::endl;
+  auto dst = lua_util::lua_env();
+  auto* L = dst.env();
+
+  eval(src.env(), "copy_src = { 10, 'twenty', shared = {} } copy_src.a = copy_src.shared copy_src.b = copy_src.shared return true");
+  lua_getglobal(src.env(), "copy_src");
+  check(dst.copy_from(src, -1) == nullptr, "copy a table");
+  lua_pop(src.env(), 1);
+  lua_setglobal(L, "copied");
+  check(eval(L, "return copied[1] == 10 and copied[2] == 'twenty' and copied.a == copied.b"), "copied table keeps sharing");
+
+  lua_pushcfunction(src.env(), print);
+  check(dst.copy_from(src, -1) != nullptr && lua_gettop(L) == 0, "functions are rejected");
+  lua_pop(src.env(), 1);
+}
+
+void test_actor() {
+  using namespace lua_util;
+  std::cout << ">> env_actor:" << std::endl;
+
+  lua_ref add = nullptr, text = nullptr, fail = nullptr, echo = nullptr;
+  auto actor = env_actor([&](lua_env &env) {
+    if (!eval(env.env(), "function add(a, b) return a + b end function text() return 'text' end "
+      "function fail() error({}) end function echo(s) return s end return true")) throw std::runtime_error("actor setup failed");
+    add = env.ref_global("add");
+    text = env.ref_global("text");
+    fail = env.ref_global("fail");
+    echo = env.ref_global("echo");
+  });
+
+  // submit 之后的 future 保证 setup 已完成
+  const auto top = actor.submit([](lua_env &env) { return lua_gettop(env.env()); }).get();
+  check(actor.call<double>(add, 1.5, 2.0).get() == 3.5, "actor call");
+  check(actor.call<std::string>(text).get() == "text", "actor string result");
+  check_throws([&] { actor.call<double>(text).get(); }, "wrong-typed actor result throws");
+  check_throws([&] { actor.call(fail).get(); }, "error({}) in an actor call throws");
+  check(actor.submit([](lua_env &env) { return lua_gettop(env.env()); }).get() == top, "actor stack is restored");
+
+  // C 字符串参数在调用前就已释放
+  auto name = std::make_unique<char[]>(8);
+  std::strcpy(name.get(), "echo");
+  auto echoed = actor.call<std::string>(echo, (const char*)name.get());
+  name.reset();
+  check(echoed.get() == "echo", "actor copies C string arguments");
+
+  check_throws([] { env_actor([](lua_env &) { throw std::runtime_error("setup"); }); }, "actor setup error is rethrown");
+}
+
+struct Vec2 {
+  double x;
+  double y;
+
+  Vec2(double x, double y) : x(x), y(y) {
+    if (!std::isfinite(x) || !std::isfinite(y)) throw std::invalid_argument("Vec2 needs finite components");
+  }
+
+  double length() const noexcept { return std::sqrt(x * x + y * y); }
+  Vec2 scaled(double k) const { return Vec2(x * k, y * k); }
+};
+
+template<> struct lua_util::arg<Vec2> : lua_util::usertype_arg<Vec2> {};
+
+/// globals for the checks in main.lua
+void bind_features(lua_util::lua_env &env) {
+  using namespace lua_util;
+  auto* L = env.env();
+
+  eval(L, "config_src = { 10, 20, 30, name = 'demo', window = { size = { 800, 600 } } } return true");
+  lua_getglobal(L, "config_src");
+  const auto config = std::make_shared<std::vector<uint8_t>>(static_table::build(L, -1));
+  lua_pop(L, 1);
+  static_table::push(L, *config, config);
+  lua_setglobal(L, "Config");
+
+  const auto blob = std::make_shared<std::vector<uint8_t>>(std::vector<uint8_t>{ 1, 2, 3, 4, 5, 6, 7, 8 });
+  bytes::push(L, *blob, blob);
+  lua_setglobal(L, "Blob");
+
+  env.bind("f32", std::array<lua_bind_data, 1>{{ { "new", f32_array::lua_new } }});
+  env.bind("i32", std::array<lua_bind_data, 1>{{ { "new", i32_array::lua_new } }});
+
+  usertype<Vec2>(L, "Vec2")
+    .constructor<double, double>()
+    .method<&Vec2::length>("length")
+    .method<&Vec2::scaled>("scaled")
+    .property<&Vec2::x>("x")
+    .property<&Vec2::y>("y")
+    .finish();
+}
+
 int main() {
   // create lua env state
   auto env = lua_util::lua_env();
@@ -86,9 +697,10 @@ int main() {
   env.bind("Ext", Ext);
   env.bind("Ext.Str", "FuncC", Ext_Str_FuncC);
   env.bind("print", print);
+  bind_features(env);
 
   // call
-  env.call();
+  check(env.call() == nullptr, "main.lua");
 
   // push val
   env.push(79837);
@@ -96,5 +708,30 @@ int main() {
   // ref and call lua func
   const auto luaFunc = env.ref_global("LuaFunc");
   env.call(luaFunc, 0.125, "\"luaFunc strValue\"");
-  return 0;
+
+  const auto dir = std::filesystem::temp_directory_path();
+  test_byte_io();
+  test_archive(dir);
+  test_chunk_stack();
+  test_hot_order();
+  test_deduplicate();
+  test_checksum();
+  test_frozen_tree();
+  test_tree_view();
+  test_resolve_cache();
+  test_module_index();
+  test_require_stats();
+  test_module_archive();
+  test_lua_pack();
+  test_lua_embed();
+  test_lazy_require();
+  test_reload(dir);
+  test_enumerate();
+  test_codec(env);
+  test_copy_from(env);
+  test_actor();
+
+  if (failures) std::cout << ">> " << failures << " checks failed" << std::endl;
+  else std::cout << ">> all checks passed" << std::endl;
+  return failures ? 1 : 0;
 }
@@ -16,3 +16,51 @@ print(">> call Ext.FuncB return:" .. (ret or "nil"))
 function LuaFunc(doubeVal, strVal)
   print("LuaFunc called: doubleVal = "..doubeVal..", strVal="..strVal)
 end
+
+print(">> static_table:")
+assert(Config.name == "demo" and Config[2] == 20 and #Config == 3)
+assert(Config.window == Config.window and Config.window.size[1] == 800)
+local seen = { [Config.window] = true }
+assert(seen[Config.window])
+local count = 0
+for _ in pairs(Config) do count = count + 1 end
+assert(count == 5)
+assert(not pcall(function() Config.name = "changed" end))
+print(">> static_table ok")
+
+print(">> bytes:")
+assert(#Blob == 8 and Blob:u8() == 1 and Blob:u32le(1) == 0x04030201 and Blob:u16be(7) == 0x0708)
+assert(Blob:sub(3, 4):string() == "\3\4" and Blob:sub(-2):u8(2) == 8)
+assert(Blob:sub(math.mininteger):string() == Blob:string())
+assert(#Blob:sub(math.mininteger, math.mininteger) == 0)
+assert(not pcall(Blob.u32le, Blob, 6) and not pcall(Blob.u8, {}))
+print(">> bytes ok")
+
+print(">> typed_array:")
+local a = f32.new({ 1, 2, 3, 4 })
+local b = f32.new(4)
+b:fill(2)
+a:mul(b)
+a:add(1)
+assert(#a == 4 and a:sum() == 24 and a:min() == 3 and a:max() == 9 and a:dot(b) == 48)
+local gathered = f32.new(4)
+gathered:gather(a, i32.new({ 4, 3, 2, 1 }))
+assert(gathered[1] == 9 and gathered[4] == 3 and gathered[5] == nil)
+local ok, err = pcall(f32.new, math.maxinteger)
+assert(not ok and err:find("too large"))
+assert(not pcall(f32.new, { 1, "x" }) and not pcall(function() a[5] = 1 end))
+assert(not pcall(i32.new, { 1 << 40 }) and not pcall(function() i32.new(1)[1] = 300 << 32 end))
+print(">> typed_array ok")
+
+print(">> usertype:")
+local v = Vec2.new(3, 4)
+assert(v:length() == 5)
+v.x = 6
+v.y = 8
+assert(v.x == 6 and v:length() == 10 and v:scaled(0.5).y == 4 and v:scaled(2):length() == 20)
+ok, err = pcall(Vec2.new, 0 / 0, 0)
+assert(not ok and err:find("finite"))
+ok, err = pcall(v.length, {})
+assert(not ok and err:find("Vec2"))
+assert(not pcall(function() v.z = 1 end))
+print(">> usertype ok")